@@ -0,0 +1,405 @@
+// bench.cpp - micro-benchmarks for the solver kernels (solver.cpp)
+// Compile: make bench
+//
+// Times incidence validation, edge-list validation, varint decoding, CSR
+// build and every search/queue combination on synthetic graph families,
+// and reports ns/op, heap allocations/op and throughput. --json writes
+// the same results in a form meant for diffing two runs.
+
+#include <bits/stdc++.h>
+#include "protocol.h"
+#include "solver.h"
+using namespace std;
+
+using Clock = chrono::steady_clock;
+
+/*==========================================================================
+ * ALLOCATION COUNTING
+ *==========================================================================*/
+
+// Every operator new in the process goes through here; the benchmarks
+// are single-threaded, so the counter only needs to be atomic for the
+// runtime's own threads.
+static atomic<uint64_t> allocs{0};
+
+// GCC pairs ::operator new with free() after inlining and flags it; the
+// pairing is exactly what these replacements intend.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t sz){
+    allocs.fetch_add(1, memory_order_relaxed);
+    if(void* p = malloc(sz ? sz : 1)) return p;
+    throw bad_alloc();
+}
+void* operator new[](size_t sz){ return operator new(sz); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+// Keeps the compiler from discarding a result that is never read.
+template<class T>
+static inline void keep(const T& v){ asm volatile("" : : "g"(&v) : "memory"); }
+
+/*==========================================================================
+ * OPTIONS
+ *==========================================================================*/
+
+struct Options {
+    string filter;              // run benchmarks whose name contains this
+    string json;                // output file, "-" = stdout
+    double min_time = 0.2;      // seconds per repetition
+    int repeat = 5;             // repetitions; the median is reported
+    bool large = false;         // add the 1M-vertex sizes
+    uint64_t seed = 1;
+};
+
+Options opt;
+
+static void usage(){
+    cout<<"Usage: ./bench [options]\n"
+        <<"  --filter STR      only benchmarks whose name contains STR\n"
+        <<"  --json FILE       also write results as JSON (- = stdout)\n"
+        <<"  --min-time SEC    minimum time per repetition (default 0.2)\n"
+        <<"  --repeat N        repetitions, median reported (default 5)\n"
+        <<"  --large           include 1M-vertex graphs\n"
+        <<"  --seed S          graph generator seed (default 1)\n";
+}
+
+static bool parse_options(int argc, char** argv){
+    for(int i=1;i<argc;i++){
+        string o = argv[i];
+        if(o == "--large"){ opt.large = true; continue; }
+        if(i+1 >= argc) return false;
+        string v = argv[++i];
+        if(o == "--filter") opt.filter = v;
+        else if(o == "--json") opt.json = v;
+        else if(o == "--min-time") opt.min_time = atof(v.c_str());
+        else if(o == "--repeat") opt.repeat = atoi(v.c_str());
+        else if(o == "--seed") opt.seed = strtoull(v.c_str(), nullptr, 10);
+        else return false;
+    }
+    return opt.min_time > 0 && opt.repeat > 0;
+}
+
+/*==========================================================================
+ * GRAPH FAMILIES
+ *==========================================================================*/
+
+// All families are connected with weights in [1, 100].
+//   random  spanning tree + uniform random edges, m = 4n
+//   grid    sqrt(n) x sqrt(n) lattice, 4-neighbour, m ~ 2n
+//   path    a single chain, m = n - 1 (deepest possible search)
+//   dense   m = n^2 / 4, for the incidence matrix at v1-like shapes
+struct Family {
+    string name;
+    int n, m;
+    vector<Edge> edges;
+};
+
+static Family make_family(const string& kind, int n, mt19937_64& rng){
+    Family f;
+    f.name = kind;
+    auto weight = [&](){ return (int)(rng() % 100 + 1); };
+
+    if(kind == "grid"){
+        int side = max(2, (int)sqrt((double)n));
+        n = side * side;
+        for(int r=0;r<side;r++)
+            for(int c=0;c<side;c++){
+                int v = r * side + c;
+                if(c + 1 < side) f.edges.push_back({v, v + 1, weight()});
+                if(r + 1 < side) f.edges.push_back({v, v + side, weight()});
+            }
+    }
+    else if(kind == "path"){
+        for(int v=0; v+1<n; v++) f.edges.push_back({v, v + 1, weight()});
+    }
+    else {
+        size_t m = kind == "dense" ? (size_t)n * n / 4 : (size_t)n * 4;
+        for(int v=1; v<n; v++) f.edges.push_back({(int)(rng() % v), v, weight()});
+        while(f.edges.size() < m){
+            int u = rng() % n, v = rng() % n;
+            if(u != v) f.edges.push_back({u, v, weight()});
+        }
+    }
+    shuffle(f.edges.begin(), f.edges.end(), rng);
+    f.n = n;
+    f.m = f.edges.size();
+    return f;
+}
+
+// Row-major n x m incidence matrix followed by the m weights, as sent
+// with ENC_MATRIX.
+static vector<int> to_matrix(const Family& f){
+    vector<int> mat((size_t)f.n * f.m + f.m, 0);
+    for(int j=0;j<f.m;j++){
+        const Edge& e = f.edges[j];
+        mat[(size_t)e.u * f.m + j] = e.w;
+        mat[(size_t)e.v * f.m + j] = -e.w;
+        mat[(size_t)f.n * f.m + j] = e.w;
+    }
+    return mat;
+}
+
+// ENC_VARINT body without its length prefix.
+static vector<uint8_t> to_varint(const Family& f){
+    vector<uint8_t> out;
+    uint8_t tmp[30];
+    int64_t prev = 0;
+    for(auto& e : f.edges){
+        uint8_t* p = tmp;
+        p = put_varint(p, zigzag((int64_t)e.u - prev));
+        p = put_varint(p, zigzag((int64_t)e.v - e.u));
+        p = put_varint(p, (uint64_t)e.w);
+        out.insert(out.end(), tmp, p);
+        prev = e.u;
+    }
+    return out;
+}
+
+/*==========================================================================
+ * HARNESS
+ *==========================================================================*/
+
+// One benchmark runs op() repeatedly. op returns how many units of work
+// it did (bytes, edges, vertices settled) for the throughput column.
+struct Bench {
+    string name, family, unit;
+    int n, m;
+    function<uint64_t()> op;
+};
+
+struct Result {
+    string name, family, unit;
+    int n, m;
+    uint64_t iters;
+    double ns_op, ns_min, allocs_op, per_sec;
+};
+
+static Result run(const Bench& b){
+    b.op();                               // warm caches and lazy state
+
+    // Calibrate: double the batch until one batch takes ~min_time/10.
+    uint64_t batch = 1;
+    while(true){
+        auto t0 = Clock::now();
+        for(uint64_t i=0;i<batch;i++) b.op();
+        double s = chrono::duration<double>(Clock::now() - t0).count();
+        if(s >= opt.min_time / 10 || batch >= (1ULL << 30)) break;
+        batch *= 2;
+    }
+
+    vector<double> ns;
+    uint64_t total_iters = 0, total_allocs = 0, total_units = 0;
+    double total_s = 0;
+    for(int r=0;r<opt.repeat;r++){
+        uint64_t iters = 0, units = 0;
+        uint64_t a0 = allocs.load(memory_order_relaxed);
+        auto t0 = Clock::now();
+        double s = 0;
+        do {
+            for(uint64_t i=0;i<batch;i++) units += b.op();
+            iters += batch;
+            s = chrono::duration<double>(Clock::now() - t0).count();
+        } while(s < opt.min_time);
+        total_allocs += allocs.load(memory_order_relaxed) - a0;
+        ns.push_back(s * 1e9 / iters);
+        total_iters += iters;
+        total_units += units;
+        total_s += s;
+    }
+
+    sort(ns.begin(), ns.end());
+    Result R{b.name, b.family, b.unit, b.n, b.m, total_iters,
+             ns[ns.size() / 2], ns[0], (double)total_allocs / total_iters,
+             total_units / total_s};
+    return R;
+}
+
+static string human(double x){
+    char buf[32];
+    const char* suffix[] = {"", "k", "M", "G", "T"};
+    int k = 0;
+    while(x >= 1000 && k < 4){ x /= 1000; k++; }
+    snprintf(buf, sizeof(buf), "%.2f%s", x, suffix[k]);
+    return buf;
+}
+
+// The table goes to stderr when the JSON goes to stdout.
+static FILE* table = stdout;
+
+static void print_row(const Result& r){
+    fprintf(table, "%-26s %-7s %9d %9d %14.1f %10.1f %12s %s/s\n",
+           r.name.c_str(), r.family.c_str(), r.n, r.m, r.ns_op, r.allocs_op,
+           human(r.per_sec).c_str(), r.unit.c_str());
+    fflush(table);
+}
+
+static void write_json(FILE* f, const vector<Result>& rs){
+    time_t now = time(nullptr);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    fprintf(f, "{\n  \"date\": \"%s\",\n  \"compiler\": \"%s\",\n", date, __VERSION__);
+    fprintf(f, "  \"min_time\": %g,\n  \"repeat\": %d,\n  \"seed\": %llu,\n",
+            opt.min_time, opt.repeat, (unsigned long long)opt.seed);
+    fprintf(f, "  \"benchmarks\": [\n");
+    for(size_t i=0;i<rs.size();i++){
+        const Result& r = rs[i];
+        fprintf(f, "    {\"name\": \"%s\", \"family\": \"%s\", \"n\": %d, \"m\": %d, "
+                   "\"iterations\": %llu, \"ns_per_op\": %.1f, \"ns_per_op_min\": %.1f, "
+                   "\"allocs_per_op\": %.2f, \"throughput\": %.1f, \"unit\": \"%s/s\"}%s\n",
+                r.name.c_str(), r.family.c_str(), r.n, r.m, (unsigned long long)r.iters,
+                r.ns_op, r.ns_min, r.allocs_op, r.per_sec, r.unit.c_str(),
+                i + 1 < rs.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+/*==========================================================================
+ * BENCHMARKS
+ *==========================================================================*/
+
+// Graphs are shared by the closures below and live until exit.
+static deque<Family> families;
+static deque<vector<int>> matrices;
+static deque<vector<uint8_t>> varints;
+static deque<CsrGraph> csrs;
+static deque<Landmarks> landmarks;
+
+// Fixed query endpoints, cycled through by the search benchmarks.
+static vector<pair<int,int>> queries(int n, mt19937_64& rng){
+    vector<pair<int,int>> q(64);
+    for(auto& p : q) p = {(int)(rng() % n), (int)(rng() % n)};
+    return q;
+}
+
+static void add_validation(vector<Bench>& out, const Family& f){
+    if((size_t)f.n * f.m <= (64u << 20)){   // matrix fits in 256 MB
+        matrices.push_back(to_matrix(f));
+        const vector<int>& mat = matrices.back();
+        out.push_back({"validate/incidence", f.name, "bytes", f.n, f.m, [&f, &mat](){
+            vector<Edge> edges;
+            bool ok = incidence_to_edges(f.n, f.m, mat.data(), mat.data() + (size_t)f.n * f.m, edges);
+            keep(ok);
+            return (uint64_t)mat.size() * sizeof(int);
+        }});
+    }
+
+    out.push_back({"validate/edges", f.name, "edges", f.n, f.m, [&f](){
+        bool ok = valid_edges(f.n, f.edges);
+        keep(ok);
+        return (uint64_t)f.m;
+    }});
+
+    varints.push_back(to_varint(f));
+    const vector<uint8_t>& var = varints.back();
+    out.push_back({"decode/varint", f.name, "edges", f.n, f.m, [&f, &var](){
+        vector<Edge> edges;
+        bool ok = decode_varint_edges(var, f.m, edges);
+        keep(ok);
+        return (uint64_t)f.m;
+    }});
+}
+
+static void add_build(vector<Bench>& out, const Family& f){
+    out.push_back({"build/csr", f.name, "edges", f.n, f.m, [&f](){
+        CsrGraph g = build_csr(f.n, f.edges);
+        keep(g);
+        return (uint64_t)f.m;
+    }});
+}
+
+static void add_search(vector<Bench>& out, const Family& f, mt19937_64& rng){
+    csrs.push_back(build_csr(f.n, f.edges));
+    const CsrGraph& g = csrs.back();
+    auto q = queries(f.n, rng);
+
+    const pair<const char*, PqKind> pqs[] = {{"binary", PQ_BINARY}, {"dary", PQ_DARY},
+                                             {"radix", PQ_RADIX}};
+    for(auto& [name, pq] : pqs){
+        out.push_back({string("dijkstra/") + name, f.name, "settled", f.n, f.m,
+                       [&g, q, pq = pq, i = size_t(0)]() mutable {
+            auto [S, T] = q[i++ % q.size()];
+            PathResult R = dijkstra(g, S, T, pq);
+            keep(R);
+            return (uint64_t)R.settled;
+        }});
+    }
+
+    // Bidirectional and ALT follow the server's queue choice (PQ_AUTO).
+    out.push_back({"bidir/auto", f.name, "settled", f.n, f.m, [&g, q, i = size_t(0)]() mutable {
+        auto [S, T] = q[i++ % q.size()];
+        PathResult R = shortest_path(g, S, T, SEARCH_MODE_BIDIR);
+        keep(R);
+        return (uint64_t)R.settled;
+    }});
+
+    landmarks.push_back(build_landmarks(g));
+    const Landmarks& lm = landmarks.back();
+    out.push_back({"alt/auto", f.name, "settled", f.n, f.m, [&g, &lm, q, i = size_t(0)]() mutable {
+        auto [S, T] = q[i++ % q.size()];
+        PathResult R = shortest_path(g, S, T, SEARCH_MODE_ALT, &lm);
+        keep(R);
+        return (uint64_t)R.settled;
+    }});
+
+    out.push_back({"landmarks/build", f.name, "vertices", f.n, f.m, [&g](){
+        Landmarks L = build_landmarks(g);
+        keep(L);
+        return (uint64_t)g.n * L.ids.size();
+    }});
+}
+
+/*==========================================================================
+ * MAIN
+ *==========================================================================*/
+
+int main(int argc, char** argv){
+    if(!parse_options(argc, argv)){
+        usage();
+        return 1;
+    }
+
+    mt19937_64 rng(opt.seed);
+    vector<int> sizes = {1000, 16000, 256000};
+    if(opt.large) sizes.push_back(1000000);
+
+    vector<Bench> benches;
+    auto add = [&](const string& kind, int n){
+        families.push_back(make_family(kind, n, rng));
+        const Family& f = families.back();
+        add_validation(benches, f);
+        add_build(benches, f);
+        add_search(benches, f, rng);
+    };
+    for(int n : {12, 19, 256, 1024}) add("dense", n);
+    for(int n : sizes){
+        add("random", n);
+        add("grid", n);
+    }
+    add("path", sizes.back());
+
+    if(opt.json == "-") table = stderr;
+    fprintf(table, "%-26s %-7s %9s %9s %14s %10s %14s\n",
+           "benchmark", "family", "n", "m", "ns/op", "allocs/op", "throughput");
+    vector<Result> results;
+    for(auto& b : benches){
+        if(!opt.filter.empty() && (b.name + "/" + b.family).find(opt.filter) == string::npos)
+            continue;
+        results.push_back(run(b));
+        print_row(results.back());
+    }
+
+    if(!opt.json.empty()){
+        FILE* f = opt.json == "-" ? stdout : fopen(opt.json.c_str(), "w");
+        if(!f){
+            perror("json");
+            return 1;
+        }
+        write_json(f, results);
+        if(f != stdout) fclose(f);
+    }
+    return 0;
+}
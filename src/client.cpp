@@ -37,13 +37,31 @@ string gen_id() {
 
 void show_usage(const char* program_name) {
     cout << "Usage:\n"
-         << "  " << program_name << " <IP> <TCP|UDP> <PORT>\n"
+         << "  " << program_name << " <IP> <TCP|UDP> <PORT> [--edges] [--mtu BYTES]\n"
+         << "  --edges   send the graph as (u, v, w) edges instead of the incidence matrix\n"
+         << "  --mtu     UDP path MTU; uploads pack rows/edges into datagrams of this\n"
+         << "            size (default 1500)\n"
          << "Example:\n"
          << "  " << program_name << " 127.0.0.1 TCP 1234\n\n";
 }
 
+// Payload encoding sent to the server (ENC_MATRIX or ENC_EDGES)
+int encoding = ENC_MATRIX;
+
+// Path MTU used to size UDP upload chunks
+int udp_mtu = 1500;
+
 bool parse_arguments(int argc, char* argv[], string& server_ip, int& proto, int& port) {
-    if (argc != 4) return false;
+    if (argc < 4) return false;
+    for (int i = 4; i < argc; i++) {
+        string opt = argv[i];
+        if (opt == "--edges") encoding = ENC_EDGES;
+        else if (opt == "--mtu" && i + 1 < argc) {
+            udp_mtu = atoi(argv[++i]);
+            if (udp_mtu < 128 || udp_mtu > 65535) return false;
+        }
+        else return false;
+    }
 
     server_ip = argv[1];
 
@@ -279,17 +297,49 @@ bool get_graph_data(int& n, int& m, int& s, int& t,
 }
 
 /* -----------------------------------------------------------------------
- *  TCP SEND
+ *  EDGE LIST ENCODING
  * ----------------------------------------------------------------------- */
 
-bool send_graph_to_server_tcp(
-    const string& server_ip, int port,
-    int n,int m,int s,int t,
-    const vector<int>& mat,
-    const vector<int>& weights)
+// (u, v, w) per edge, u = row holding +w, v = row holding -w
+vector<int32_t> edges_from_matrix(int n, int m, const vector<int>& mat,
+                                  const vector<int>& weights)
 {
+    vector<int32_t> out(3*m, 0);
+    for(int e=0;e<m;e++){
+        for(int v=0;v<n;v++){
+            if(mat[v*m+e] > 0) out[3*e]   = v;
+            if(mat[v*m+e] < 0) out[3*e+1] = v;
+        }
+        out[3*e+2] = weights[e];
+    }
+    return out;
+}
+
+/* -----------------------------------------------------------------------
+ *  TCP SEND
+ * ----------------------------------------------------------------------- */
+
+// Connection reused across graphs (protocol v2 keep-alive), -1 if closed
+int tcp_sock = -1;
+uint64_t next_request_id = 1;
+
+// Longest message a solve reply carries; the rest is a path of at most
+// n vertices.
+const size_t MAX_REPLY_MESSAGE = 65536;
+
+static bool recv_all(int sock, void* buf, size_t len){
+    char* p = (char*)buf;
+    while(len > 0){
+        ssize_t r = recv(sock, p, len, 0);
+        if(r <= 0) return false;
+        p += r; len -= r;
+    }
+    return true;
+}
+
+static int tcp_connect(const string& server_ip, int port){
     int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if(sock<0){ perror("socket"); return false; }
+    if(sock<0){ perror("socket"); return -1; }
 
     sockaddr_in srv{}; 
     srv.sin_family = AF_INET;
@@ -299,44 +349,106 @@ bool send_graph_to_server_tcp(
     if(connect(sock,(sockaddr*)&srv,sizeof(srv))<0){
         perror("connect");
         close(sock);
-        return false;
+        return -1;
     }
+    return sock;
+}
 
-    GraphRequest req{n,m,s,t,0};
-    if(send(sock,&req,sizeof(req),0)!=sizeof(req)){
-        perror("send req");
-        close(sock); return false;
-    }
-    if(send(sock,mat.data(),mat.size()*sizeof(int),0) 
-       != (ssize_t)mat.size()*sizeof(int)){
-        perror("send mat");
-        close(sock); return false;
+// One request/response on the open connection. false = connection
+// broken, or a reply that cannot be one (longer than max_body, or whose
+// message and path do not fit in its body).
+static bool tcp_exchange(const vector<char>& req, uint64_t id, size_t max_body,
+                         GraphResponseV2& H, vector<char>& body)
+{
+    if(send(tcp_sock, req.data(), req.size(), MSG_NOSIGNAL) != (ssize_t)req.size())
+        return false;
+
+    // Only one request is outstanding, but skip anything not ours anyway
+    do {
+        if(!recv_all(tcp_sock, &H, sizeof(H))) return false;
+        if(H.body_len > max_body) return false;
+        body.resize(H.body_len);
+        if(!recv_all(tcp_sock, body.data(), body.size())) return false;
+    } while(H.request_id != id);
+    return H.message_len <= H.body_len &&
+           H.path_size <= (H.body_len - H.message_len) / sizeof(int64_t);
+}
+
+bool send_graph_to_server_tcp(
+    const string& server_ip, int port,
+    int n,int m,int s,int t,
+    const vector<int>& mat,
+    const vector<int>& weights)
+{
+    uint64_t id = next_request_id++;
+
+    GraphRequest req{n,m,s,t,make_reserved(PROTO_V2, encoding) | FLAG_KEEPALIVE};
+    GraphRequestV2 req2{(uint64_t)n,(uint64_t)m,(uint64_t)s,(uint64_t)t,id};
+
+    vector<char> buf;
+    auto append = [&](const void* p, size_t len){
+        buf.insert(buf.end(), (const char*)p, (const char*)p + len);
+    };
+    append(&req, sizeof(req));
+    append(&req2, sizeof(req2));
+    if(encoding == ENC_EDGES){
+        vector<int32_t> edges = edges_from_matrix(n,m,mat,weights);
+        append(edges.data(), edges.size()*sizeof(int32_t));
     }
-    if(send(sock,weights.data(),weights.size()*sizeof(int),0)
-       != (ssize_t)weights.size()*sizeof(int)){
-        perror("send weights");
-        close(sock); return false;
+    else {
+        append(mat.data(), mat.size()*sizeof(int));
+        append(weights.data(), weights.size()*sizeof(int));
     }
 
-    GraphResponse R{};
-    ssize_t got = recv(sock,&R,sizeof(R),MSG_WAITALL);
-
-    if(got==sizeof(R)){
-        if(R.error_code==0){
-            cout<<"\n=== RESULT (TCP) ===\n"
-                <<"Path length: "<<R.path_length<<"\n"
-                <<"Path: ";
-            for(int i=0;i<R.path_size;i++)
-                cout<<R.path[i]<<(i+1<R.path_size?"->":"");
-            cout<<"\n";
-        }
-        else{
-            cout<<"Server error: "<<R.message<<"\n";
+    GraphResponseV2 H{};
+    vector<char> body;
+    bool ok = false;
+    const int MAX_BUSY_RETRIES = 3;
+
+    for(int busy=0; ; busy++){
+        // A reused connection may have been closed by the server meanwhile
+        // (idle timeout, restart): retry once on a fresh one.
+        ok = false;
+        for(int attempt=0; attempt<2 && !ok; attempt++){
+            bool fresh = tcp_sock < 0;
+            if(fresh && (tcp_sock = tcp_connect(server_ip, port)) < 0) return false;
+
+            ok = tcp_exchange(buf, id, MAX_REPLY_MESSAGE + (size_t)n * sizeof(int64_t), H, body);
+            if(!ok){
+                close(tcp_sock);
+                tcp_sock = -1;
+                if(fresh) break;
+            }
         }
+        if(!ok || H.error_code != ERR_BUSY || busy == MAX_BUSY_RETRIES) break;
+
+        // Refused, nothing was solved: send the same request again once
+        // the wait is over.
+        cout<<"Server busy, retrying in "<<H.distance<<" ms\n";
+        this_thread::sleep_for(chrono::milliseconds(H.distance));
     }
-    else cerr<<"No or incomplete response\n";
 
-    close(sock);
+    if(!ok){
+        cerr<<"No or incomplete response\n";
+        return true;
+    }
+
+    string msg(body.data(), min<size_t>(H.message_len, body.size()));
+    if(H.error_code==0){
+        const char* p = body.data() + H.message_len;
+        cout<<"\n=== RESULT (TCP) ===\n"
+            <<"Path length: "<<H.distance<<"\n"
+            <<"Path: ";
+        for(uint64_t i=0;i<H.path_size;i++){
+            int64_t v;
+            memcpy(&v, p + i*sizeof(v), sizeof(v));
+            cout<<v<<(i+1<H.path_size?"->":"");
+        }
+        cout<<"\n";
+    }
+    else{
+        cout<<"Server error: "<<msg<<"\n";
+    }
     return true;
 }
 
@@ -364,36 +476,51 @@ bool send_graph_to_server_udp(
     /* -------- helper lambdas to send packets -------- */
 
     auto send_header = [&](int sock)->bool{
-        vector<uint8_t> buf(sizeof(UdpPacketHeader)+16);
+        vector<uint8_t> buf(sizeof(UdpPacketHeader)+20);
         UdpPacketHeader* h=(UdpPacketHeader*)buf.data();
         memcpy(h->cid,cid,9); h->type=UDP_HEADER;
         uint8_t* p = buf.data()+sizeof(UdpPacketHeader);
         auto put = [&](int32_t x){ int32_t y=htonl(x); memcpy(p,&y,4); p+=4; };
-        put(n); put(m); put(s); put(t);
+        put(n); put(m); put(s); put(t); put(encoding);
         return sendto(sock,buf.data(),buf.size(),0,(sockaddr*)&srv,sizeof(srv))
                 == (ssize_t)buf.size();
     };
 
-    auto send_row = [&](int sock,int row)->bool{
-        vector<uint8_t> buf(sizeof(UdpPacketHeader)+4 + m*4);
-        UdpPacketHeader* h=(UdpPacketHeader*)buf.data();
-        memcpy(h->cid,cid,9); h->type=UDP_ROW;
-        uint8_t* p = buf.data()+sizeof(UdpPacketHeader);
-        auto put = [&](int32_t x){ int32_t y=htonl(x); memcpy(p,&y,4); p+=4; };
-        put(row);
-        for(int j=0;j<m;j++) put(mat[row*m+j]);
-        return sendto(sock,buf.data(),buf.size(),0,(sockaddr*)&srv,sizeof(srv))
-                == (ssize_t)buf.size();
-    };
+    // UDP_CHUNK: as many units (rows, then the weights as row n, or
+    // edges) as fit in one datagram of the path MTU
+    vector<int32_t> edges;
+    if(encoding == ENC_EDGES) edges = edges_from_matrix(n,m,mat,weights);
+
+    const size_t IP_UDP_OVERHEAD = 28;
+    const size_t fixed = sizeof(UdpPacketHeader) + 16;
+    int units = encoding == ENC_EDGES ? m : n + 1;
+    size_t unit_ints = encoding == ENC_EDGES ? 3 : m;
+    size_t room = udp_mtu - IP_UDP_OVERHEAD - fixed;
+    int per_chunk = max<size_t>(1, room / max<size_t>(4*unit_ints, 1));
+    int chunks = (units + per_chunk - 1) / per_chunk;
+    if(fixed + 4*unit_ints > 65507){
+        cout << "Graph rows too large for UDP, use TCP\n";
+        close(sock);
+        return false;
+    }
 
-    auto send_weights = [&](int sock)->bool{
-        vector<uint8_t> buf(sizeof(UdpPacketHeader)+4 + m*4);
+    auto send_chunk = [&](int sock,int seq)->bool{
+        int first = seq * per_chunk;
+        int count = min(per_chunk, units - first);
+        vector<uint8_t> buf(fixed + 4*unit_ints*count);
         UdpPacketHeader* h=(UdpPacketHeader*)buf.data();
-        memcpy(h->cid,cid,9); h->type=UDP_WEIGHTS;
+        memcpy(h->cid,cid,9); h->type=UDP_CHUNK;
         uint8_t* p = buf.data()+sizeof(UdpPacketHeader);
         auto put = [&](int32_t x){ int32_t y=htonl(x); memcpy(p,&y,4); p+=4; };
-        put(m);
-        for(int j=0;j<m;j++) put(weights[j]);
+        put(seq); put(chunks); put(first); put(count);
+        for(int k=first;k<first+count;k++){
+            if(encoding == ENC_EDGES){
+                for(int j=0;j<3;j++) put(edges[3*k+j]);
+            } else {
+                const int* row = k < n ? &mat[(size_t)k*m] : weights.data();
+                for(int j=0;j<m;j++) put(row[j]);
+            }
+        }
         return sendto(sock,buf.data(),buf.size(),0,(sockaddr*)&srv,sizeof(srv))
                 == (ssize_t)buf.size();
     };
@@ -408,9 +535,37 @@ bool send_graph_to_server_udp(
 
     /* -------- sequence sender -------- */
 
-    send_header(sock);
-    for(int i=0;i<n;i++) send_row(sock,i);
-    send_weights(sock);
+    auto send_all = [&](int sock){
+        send_header(sock);
+        for(int c=0;c<chunks;c++) send_chunk(sock,c);
+    };
+
+    // Resends what a UDP_NACK lists; returns the number of datagrams sent.
+    auto resend_missing = [&](int sock, const uint8_t* p, ssize_t len)->int{
+        auto get = [&](){ int32_t x; memcpy(&x,p,4); p+=4; return (int32_t)ntohl(x); };
+        int32_t header_missing = get(), weights_missing = get();
+        int32_t first = get(), count = get();
+        len -= 16;
+        if(header_missing){ send_all(sock); return 1; }
+
+        int listed = encoding == ENC_EDGES ? m : n;
+        if(first < 0 || count < 0 || count > listed - first || len < (count+7)/8) return 0;
+
+        // resend each chunk holding a missing unit once
+        int sent = 0, last = -1;
+        for(int i=0;i<count;i++){
+            if(!((p[i/8] >> (i%8)) & 1)) continue;
+            int seq = (first + i) / per_chunk;
+            if(seq == last) continue;
+            send_chunk(sock,seq);
+            last = seq;
+            sent++;
+        }
+        if(weights_missing && n / per_chunk != last){ send_chunk(sock,n / per_chunk); sent++; }
+        return sent;
+    };
+
+    send_all(sock);
     send_fin(sock);
     /* -------- retry loop (ACK) -------- */
 
@@ -419,8 +574,12 @@ bool send_graph_to_server_udp(
 bool acked = false;
 int attempts = 0;
 const int MAX_ATTEMPTS = 3;
+int nack_rounds = 0;
+const int MAX_NACK_ROUNDS = 20;
+int busy_rounds = 0;
+const int MAX_BUSY_ROUNDS = 3;
 
-uint8_t recvbuf[4096];
+uint8_t recvbuf[65536];
 
     while(attempts < MAX_ATTEMPTS && !acked){
         attempts++;
@@ -453,6 +612,38 @@ uint8_t recvbuf[4096];
                 UdpPacketHeader* h=(UdpPacketHeader*)recvbuf;
 
                 if(strncmp(h->cid,cid,8)==0){
+                    if(h->type == UDP_NACK && r >= (ssize_t)sizeof(UdpPacketHeader)+16){
+                        if(++nack_rounds > MAX_NACK_ROUNDS){
+                            cout << "UDP: Server still missing data after "
+                                 << MAX_NACK_ROUNDS << " resends\n";
+                            break;
+                        }
+                        int k = resend_missing(sock, recvbuf+sizeof(UdpPacketHeader),
+                                               r-sizeof(UdpPacketHeader));
+                        cout << "UDP: Server missing data, resent " << k << " packet(s)\n";
+                        send_fin(sock);
+                        attempts = 0;   // progress, not a timeout
+                        continue;
+                    }
+                    if(h->type == UDP_BUSY && r >= (ssize_t)sizeof(UdpPacketHeader)+4){
+                        if(++busy_rounds > MAX_BUSY_ROUNDS){
+                            cout << "UDP: Server busy, giving up\n";
+                            break;
+                        }
+                        int32_t ms;
+                        memcpy(&ms, recvbuf+sizeof(UdpPacketHeader), 4);
+                        ms = ntohl(ms);
+                        cout << "UDP: Server busy, retrying in " << ms << " ms\n";
+                        this_thread::sleep_for(chrono::milliseconds(ms));
+
+                        // the server dropped the session: forget replies to
+                        // the refused upload and start over
+                        while(recv(sock, recvbuf, sizeof(recvbuf), MSG_DONTWAIT) > 0) {}
+                        send_all(sock);
+                        send_fin(sock);
+                        attempts = 0;
+                        continue;
+                    }
                     if(h->type == UDP_ACK){
                         acked = true;
                         cout << "UDP: Acknowledgment received\n";
@@ -613,5 +804,6 @@ int main(int argc, char* argv[]){
         // Sinon, on continue la boucle
     }
 
+    if(tcp_sock >= 0) close(tcp_sock);
     return 0;
 }
@@ -0,0 +1,725 @@
+// loadgen.cpp - load generator for the graph server
+// Compile: g++ loadgen.cpp -o loadgen -std=c++17 -O2 -pthread
+//
+// Drives many concurrent TCP (protocol v2) or UDP clients against the
+// server, either as fast as each client can go (closed loop) or at a
+// fixed total rate (open loop), and reports throughput and latency
+// percentiles. Open-loop latency is measured from the time a request was
+// due, not the time it went out, so a stalled server is not hidden by
+// clients that fell behind their schedule.
+
+#include <bits/stdc++.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "protocol.h"
+using namespace std;
+
+using Clock = chrono::steady_clock;
+
+/*==========================================================================
+ * OPTIONS
+ *==========================================================================*/
+
+struct Options {
+    string ip;
+    int port = 0;
+    bool udp = false;
+    int conns = 64;                 // concurrent clients
+    int threads = 0;                // 0 = number of cores
+    double rate = 0;                // total requests/s, 0 = closed loop
+    double duration = 10;           // measured seconds
+    double warmup = 1;              // seconds before measuring
+    int n = 1000, m = 4000;         // graph size
+    int encoding = ENC_EDGES;
+    int graphs = 16;                // distinct graphs sent
+    bool reconnect = false;         // TCP: one connection per request
+    int mtu = 1500;                 // UDP chunk size
+    int timeout_ms = 2000;          // per attempt
+    int retries = 3;                // UDP: FIN resends before a timeout
+    uint64_t seed = 1;
+};
+
+Options opt;
+
+static void usage(){
+    cout<<"Usage: ./loadgen <IP> <PORT> [options]\n"
+        <<"  --udp             use the UDP protocol (default TCP, protocol v2)\n"
+        <<"  --conns N         concurrent clients (default 64)\n"
+        <<"  --threads N       client threads (default: number of cores)\n"
+        <<"  --rate QPS        open loop at QPS requests/s in total;\n"
+        <<"                    default 0 = closed loop, each client back to back\n"
+        <<"  --duration SEC    measured time (default 10)\n"
+        <<"  --warmup SEC      unmeasured time first (default 1)\n"
+        <<"  --vertices N      vertices per graph (default 1000; UDP 6..19)\n"
+        <<"  --edges M         edges per graph, at least N-1 (default 4000; UDP 6..19)\n"
+        <<"  --encoding ENC    matrix|edges|varint (default edges; UDP matrix|edges)\n"
+        <<"  --graphs K        distinct graphs, requests pick one and random\n"
+        <<"                    endpoints (default 16)\n"
+        <<"  --reconnect       TCP: new connection per request (no keep-alive)\n"
+        <<"  --mtu BYTES       UDP datagram size for uploads (default 1500)\n"
+        <<"  --timeout MS      request timeout (default 2000)\n"
+        <<"  --seed S          graph generator seed (default 1)\n";
+}
+
+static bool parse_options(int argc, char** argv){
+    if(argc < 3) return false;
+    opt.ip = argv[1];
+    opt.port = atoi(argv[2]);
+    if(opt.port < 1 || opt.port > 65535) return false;
+
+    for(int i=3;i<argc;i++){
+        string o = argv[i];
+        if(o == "--udp"){ opt.udp = true; continue; }
+        if(o == "--reconnect"){ opt.reconnect = true; continue; }
+        if(i+1 >= argc) return false;
+        string v = argv[++i];
+
+        if(o == "--encoding"){
+            if(v == "matrix") opt.encoding = ENC_MATRIX;
+            else if(v == "edges") opt.encoding = ENC_EDGES;
+            else if(v == "varint") opt.encoding = ENC_VARINT;
+            else return false;
+        }
+        else if(o == "--rate")     opt.rate = atof(v.c_str());
+        else if(o == "--duration") opt.duration = atof(v.c_str());
+        else if(o == "--warmup")   opt.warmup = atof(v.c_str());
+        else if(o == "--conns")    opt.conns = atoi(v.c_str());
+        else if(o == "--threads")  opt.threads = atoi(v.c_str());
+        else if(o == "--vertices") opt.n = atoi(v.c_str());
+        else if(o == "--edges")    opt.m = atoi(v.c_str());
+        else if(o == "--graphs")   opt.graphs = atoi(v.c_str());
+        else if(o == "--mtu")      opt.mtu = atoi(v.c_str());
+        else if(o == "--timeout")  opt.timeout_ms = atoi(v.c_str());
+        else if(o == "--seed")     opt.seed = strtoull(v.c_str(), nullptr, 10);
+        else return false;
+    }
+
+    if(opt.conns < 1 || opt.graphs < 1 || opt.duration <= 0 || opt.warmup < 0 ||
+       opt.rate < 0 || opt.timeout_ms < 1 || opt.n < 2 || opt.m < opt.n - 1)
+        return false;
+    if(opt.udp && (opt.n < 6 || opt.n > 19 || opt.m < 6 || opt.m > 19 ||
+                   opt.encoding == ENC_VARINT || opt.mtu < 128 || opt.mtu > 65535))
+        return false;
+    if(opt.threads <= 0) opt.threads = max(1u, thread::hardware_concurrency());
+    opt.threads = min(opt.threads, opt.conns);
+    return true;
+}
+
+/*==========================================================================
+ * LATENCY HISTOGRAM (HDR-STYLE)
+ *==========================================================================*/
+
+// Log-linear buckets in nanoseconds: values below 128 are exact, above
+// that every power of two is split into 128 linear sub-buckets, so any
+// recorded value is reported within 1/128 (0.8%) of its true value.
+class Histogram {
+public:
+    Histogram() : counts(BUCKETS, 0) {}
+
+    void record(uint64_t ns){
+        counts[index(ns)]++;
+        total++;
+        sum += ns;
+        lo = min(lo, ns);
+        hi = max(hi, ns);
+    }
+
+    void merge(const Histogram& o){
+        for(int i=0;i<BUCKETS;i++) counts[i] += o.counts[i];
+        total += o.total;
+        sum += o.sum;
+        lo = min(lo, o.lo);
+        hi = max(hi, o.hi);
+    }
+
+    // Upper bound of the bucket holding the p-th percentile.
+    uint64_t percentile(double p) const {
+        if(!total) return 0;
+        uint64_t rank = max<uint64_t>(1, (uint64_t)ceil(p / 100.0 * total));
+        uint64_t seen = 0;
+        for(int i=0;i<BUCKETS;i++){
+            seen += counts[i];
+            if(seen >= rank) return min(upper(i), hi);
+        }
+        return hi;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t min_ns() const { return total ? lo : 0; }
+    uint64_t max_ns() const { return hi; }
+    double mean_ns() const { return total ? (double)sum / total : 0; }
+
+private:
+    static const int SUB_BITS = 7, SUB = 1 << SUB_BITS;
+    static const int BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+    vector<uint64_t> counts;
+    uint64_t total = 0, sum = 0, lo = UINT64_MAX, hi = 0;
+
+    static int index(uint64_t v){
+        if(v < (uint64_t)SUB) return (int)v;
+        int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+        return (shift + 1) * SUB + (int)((v >> shift) - SUB);
+    }
+
+    static uint64_t upper(int i){
+        if(i < SUB) return i;
+        int shift = i / SUB - 1;
+        return (((uint64_t)(i % SUB + SUB) + 1) << shift) - 1;
+    }
+};
+
+/*==========================================================================
+ * WORKLOAD
+ *==========================================================================*/
+
+struct Edge3 { int32_t u, v, w; };
+
+// A random connected graph: a random spanning tree plus random extra
+// edges, positive weights. Encoded once for every request that uses it.
+struct Graph {
+    int n, m;
+    vector<Edge3> edges;
+    vector<char> payload;            // TCP payload in opt.encoding
+    vector<int32_t> units;           // UDP units: rows + weights, or edges
+    int unit_ints = 0;
+};
+
+static Graph make_graph(int n, int m, mt19937_64& rng){
+    Graph g;
+    g.n = n; g.m = m;
+    vector<int> order(n);
+    iota(order.begin(), order.end(), 0);
+    shuffle(order.begin(), order.end(), rng);
+
+    auto weight = [&](){ return (int32_t)(rng() % 100 + 1); };
+    for(int i=1;i<n;i++){
+        int parent = order[rng() % i];
+        g.edges.push_back({parent, order[i], weight()});
+    }
+    while((int)g.edges.size() < m){
+        int u = rng() % n, v = rng() % n;
+        if(u != v) g.edges.push_back({u, v, weight()});
+    }
+    shuffle(g.edges.begin(), g.edges.end(), rng);
+
+    if(opt.udp){
+        // units in network byte order, ready to copy into UDP_CHUNKs
+        if(opt.encoding == ENC_EDGES){
+            g.unit_ints = 3;
+            for(auto& e : g.edges){
+                g.units.push_back(htonl(e.u));
+                g.units.push_back(htonl(e.v));
+                g.units.push_back(htonl(e.w));
+            }
+        } else {
+            g.unit_ints = m;
+            g.units.assign((size_t)(n + 1) * m, 0);
+            for(int j=0;j<m;j++){
+                auto& e = g.edges[j];
+                g.units[(size_t)e.u * m + j] = htonl(e.w);
+                g.units[(size_t)e.v * m + j] = htonl(-e.w);
+                g.units[(size_t)n * m + j]   = htonl(e.w);
+            }
+        }
+        return g;
+    }
+
+    auto put = [&](const void* p, size_t len){
+        g.payload.insert(g.payload.end(), (const char*)p, (const char*)p + len);
+    };
+    if(opt.encoding == ENC_EDGES){
+        put(g.edges.data(), g.edges.size() * sizeof(Edge3));
+    }
+    else if(opt.encoding == ENC_MATRIX){
+        vector<int32_t> mat((size_t)n * m + m, 0);
+        for(int j=0;j<m;j++){
+            auto& e = g.edges[j];
+            mat[(size_t)e.u * m + j] = e.w;
+            mat[(size_t)e.v * m + j] = -e.w;
+            mat[(size_t)n * m + j]   = e.w;
+        }
+        put(mat.data(), mat.size() * sizeof(int32_t));
+    }
+    else {
+        vector<uint8_t> var;
+        uint8_t tmp[30];
+        int64_t prev = 0;
+        for(auto& e : g.edges){
+            uint8_t* p = tmp;
+            p = put_varint(p, zigzag((int64_t)e.u - prev));
+            p = put_varint(p, zigzag((int64_t)e.v - e.u));
+            p = put_varint(p, (uint64_t)e.w);
+            var.insert(var.end(), tmp, p);
+            prev = e.u;
+        }
+        uint64_t len = var.size();
+        put(&len, sizeof(len));
+        put(var.data(), var.size());
+    }
+    return g;
+}
+
+vector<Graph> graphs;
+
+/*==========================================================================
+ * CLIENTS
+ *==========================================================================*/
+
+enum ClientState {
+    C_IDLE,            // waiting for the next request to be due
+    C_CONNECTING,      // TCP
+    C_SENDING,         // TCP
+    C_RECEIVING,       // TCP
+    C_WAIT_ACK,        // UDP, upload and FIN sent
+    C_WAIT_RESULT      // UDP, FIN acknowledged
+};
+
+struct Client {
+    int fd = -1;
+    ClientState st = C_IDLE;
+    Clock::time_point due;            // when the current/next request is due
+    Clock::time_point deadline;       // current attempt times out
+    uint64_t timer_gen = 0;
+
+    // TCP
+    char head[sizeof(GraphRequest) + sizeof(GraphRequestV2)];
+    const Graph* g = nullptr;
+    size_t sent = 0;                  // bytes of head + payload written
+    GraphResponseV2 resp;
+    size_t got = 0;                   // bytes of resp + body read
+    uint64_t request_id = 0;
+
+    // UDP
+    char cid[9];
+    int tries = 0, S = 0, T = 0;
+};
+
+enum Outcome { DONE_OK, DONE_ERROR, DONE_TIMEOUT, DONE_BUSY };
+
+struct Totals {
+    Histogram hist;
+    uint64_t ok = 0, errors = 0, timeouts = 0, busy = 0, retransmits = 0;
+    uint64_t late = 0;                // open loop: sent after being due
+};
+
+atomic<uint64_t> next_cid{0};
+
+// One thread's clients, driven by one epoll loop. Each client has one
+// request in flight at a time and one timer: the next request being due
+// while idle, the attempt deadline while busy.
+class Worker {
+public:
+    Worker(int index, int count) : first(index), nclients(count) {}
+
+    void run(Clock::time_point start, Clock::time_point measure, Clock::time_point end){
+        this->measure = measure;
+        rng.seed(opt.seed * 7919 + first);
+        ep = epoll_create1(0);
+        clients.resize(nclients);
+
+        // interval between one client's requests in open loop; clients
+        // are staggered evenly across it
+        if(opt.rate > 0) interval = chrono::duration_cast<Clock::duration>(
+                             chrono::duration<double>(opt.conns / opt.rate));
+        for(int i=0;i<nclients;i++){
+            Client& c = clients[i];
+            c.due = start + interval * (first + i) / opt.conns;
+            if(opt.udp) open_udp(i);
+            arm(i, c.due);
+        }
+
+        vector<epoll_event> evs(256);
+        while(true){
+            auto now = Clock::now();
+            if(now >= end) break;
+            fire(now);
+
+            auto wake = end;
+            if(!timers.empty()) wake = min(wake, timers.top().at);
+            auto wait = max(Clock::duration::zero(), wake - Clock::now());
+            auto ns = chrono::duration_cast<chrono::nanoseconds>(wait).count();
+            timespec ts{(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+
+            int k = epoll_pwait2(ep, evs.data(), evs.size(), &ts, nullptr);
+            for(int j=0;j<k;j++){
+                int i = evs[j].data.u32;
+                uint32_t e = evs[j].events;
+                if(opt.udp) on_datagrams(i);
+                else        on_tcp(i, e);
+            }
+        }
+
+        for(auto& c : clients) if(c.fd >= 0) close(c.fd);
+        close(ep);
+    }
+
+    Totals totals;
+
+private:
+    int first, nclients;
+    int ep = -1;
+    vector<Client> clients;
+    Clock::duration interval = Clock::duration::zero();
+    Clock::time_point measure;
+    mt19937_64 rng;
+
+    struct Timer {
+        Clock::time_point at;
+        int client;
+        uint64_t gen;
+        bool operator>(const Timer& o) const { return at > o.at; }
+    };
+    priority_queue<Timer, vector<Timer>, greater<Timer>> timers;
+
+    void arm(int i, Clock::time_point at){
+        Client& c = clients[i];
+        timers.push({at, i, ++c.timer_gen});
+    }
+
+    void fire(Clock::time_point now){
+        while(!timers.empty() && timers.top().at <= now){
+            Timer t = timers.top();
+            timers.pop();
+            Client& c = clients[t.client];
+            if(t.gen != c.timer_gen) continue;      // re-armed since
+            if(c.st == C_IDLE) start(t.client, now);
+            else expire(t.client);
+        }
+    }
+
+    // Starts the request that is due now.
+    void start(int i, Clock::time_point now){
+        Client& c = clients[i];
+        if(now - c.due > chrono::milliseconds(1) && opt.rate > 0 && c.due >= measure) totals.late++;
+        c.g = &graphs[rng() % graphs.size()];
+        c.S = rng() % c.g->n;
+        c.T = rng() % c.g->n;
+        c.deadline = now + chrono::milliseconds(opt.timeout_ms);
+        arm(i, c.deadline);
+        if(opt.udp) udp_start(i);
+        else        tcp_start(i);
+    }
+
+    // Records the request and schedules the next one. A busy reply's
+    // retry_ms delays a closed-loop client; open-loop clients keep to
+    // their schedule, as independent users would.
+    void finish(int i, Outcome o, int retry_ms = 0){
+        Client& c = clients[i];
+        auto now = Clock::now();
+        if(c.due >= measure){
+            if(o == DONE_OK){
+                totals.ok++;
+                totals.hist.record(chrono::duration_cast<chrono::nanoseconds>(now - c.due).count());
+            }
+            else if(o == DONE_TIMEOUT) totals.timeouts++;
+            else if(o == DONE_BUSY) totals.busy++;
+            else totals.errors++;
+        }
+
+        c.st = C_IDLE;
+        if(opt.rate > 0) c.due += interval;
+        else             c.due = now + chrono::milliseconds(retry_ms);
+        if(c.due <= now) start(i, now);
+        else arm(i, c.due);
+    }
+
+    void expire(int i){
+        Client& c = clients[i];
+        if(opt.udp && c.tries < opt.retries){
+            c.tries++;
+            totals.retransmits++;
+            udp_send(c, UDP_FIN, nullptr, 0);
+            c.deadline = Clock::now() + chrono::milliseconds(opt.timeout_ms);
+            arm(i, c.deadline);
+            return;
+        }
+        if(!opt.udp) tcp_close(i);
+        finish(i, DONE_TIMEOUT);
+    }
+
+    /* ---------------- TCP ---------------- */
+
+    void watch(int i, uint32_t events, bool add){
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u32 = i;
+        epoll_ctl(ep, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, clients[i].fd, &ev);
+    }
+
+    void tcp_close(int i){
+        Client& c = clients[i];
+        if(c.fd < 0) return;
+        close(c.fd);                   // also leaves the epoll set
+        c.fd = -1;
+    }
+
+    void tcp_start(int i){
+        Client& c = clients[i];
+        GraphRequest r{};
+        r.reserved = make_reserved(PROTO_V2, opt.encoding) | (opt.reconnect ? 0 : FLAG_KEEPALIVE);
+        GraphRequestV2 r2{};
+        r2.vertices = c.g->n;
+        r2.edges = c.g->m;
+        r2.start_node = c.S;
+        r2.end_node = c.T;
+        r2.request_id = ++c.request_id;
+        memcpy(c.head, &r, sizeof(r));
+        memcpy(c.head + sizeof(r), &r2, sizeof(r2));
+        c.sent = c.got = 0;
+
+        if(c.fd >= 0){
+            c.st = C_SENDING;
+            if(tcp_write(i)) watch(i, c.st == C_SENDING ? EPOLLOUT : EPOLLIN, false);
+            return;
+        }
+
+        c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int one = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        sockaddr_in a = server_addr();
+        if(connect(c.fd, (sockaddr*)&a, sizeof(a)) < 0 && errno != EINPROGRESS){
+            tcp_close(i);
+            finish(i, DONE_ERROR);
+            return;
+        }
+        c.st = C_CONNECTING;
+        watch(i, EPOLLOUT, true);
+    }
+
+    // Writes what it can. Returns false if the request failed.
+    bool tcp_write(int i){
+        Client& c = clients[i];
+        size_t head = sizeof(c.head), total = head + c.g->payload.size();
+        while(c.sent < total){
+            iovec iov[2];
+            int k = 0;
+            if(c.sent < head) iov[k++] = {c.head + c.sent, head - c.sent};
+            size_t off = c.sent > head ? c.sent - head : 0;
+            iov[k++] = {(void*)(c.g->payload.data() + off), c.g->payload.size() - off};
+
+            ssize_t r = writev(c.fd, iov, k);
+            if(r < 0){
+                if(errno == EAGAIN || errno == EWOULDBLOCK) return true;
+                if(errno == EINTR) continue;
+                tcp_close(i);
+                finish(i, DONE_ERROR);
+                return false;
+            }
+            c.sent += r;
+        }
+        c.st = C_RECEIVING;
+        return true;
+    }
+
+    void on_tcp(int i, uint32_t e){
+        Client& c = clients[i];
+        if(c.st == C_CONNECTING){
+            int err = 0;
+            socklen_t L = sizeof(err);
+            getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &L);
+            if(err || (e & (EPOLLERR | EPOLLHUP))){
+                tcp_close(i);
+                finish(i, DONE_ERROR);
+                return;
+            }
+            c.st = C_SENDING;
+        }
+        if(c.st == C_SENDING){
+            if(!tcp_write(i)) return;
+            if(c.st == C_SENDING){ watch(i, EPOLLOUT, false); return; }
+            watch(i, EPOLLIN, false);
+            return;
+        }
+        if(c.st == C_RECEIVING) tcp_read(i);
+    }
+
+    void tcp_read(int i){
+        Client& c = clients[i];
+        char body[65536];
+        while(true){
+            size_t hs = sizeof(c.resp);
+            ssize_t r;
+            if(c.got < hs) r = recv(c.fd, (char*)&c.resp + c.got, hs - c.got, 0);
+            else           r = recv(c.fd, body, min(sizeof(body), hs + c.resp.body_len - c.got), 0);
+            if(r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+                tcp_close(i);
+                finish(i, DONE_ERROR);
+                return;
+            }
+            if(r < 0){
+                if(errno == EINTR) continue;
+                return;
+            }
+            c.got += r;
+            // a message and one path of at most n vertices; a longer body
+            // is not a reply to our request
+            if(c.got == hs && c.resp.body_len > 65536 + (uint64_t)opt.n * sizeof(int64_t)){
+                tcp_close(i);
+                finish(i, DONE_ERROR);
+                return;
+            }
+            if(c.got >= hs && c.got == hs + c.resp.body_len) break;
+        }
+
+        bool ok = c.resp.error_code == 0 && c.resp.request_id == c.request_id;
+        if(opt.reconnect || !ok) tcp_close(i);
+        if(c.resp.error_code == ERR_BUSY) finish(i, DONE_BUSY, (int)c.resp.distance);
+        else finish(i, ok ? DONE_OK : DONE_ERROR);
+    }
+
+    /* ---------------- UDP ---------------- */
+
+    sockaddr_in server_addr(){
+        sockaddr_in a{};
+        a.sin_family = AF_INET;
+        a.sin_port = htons(opt.port);
+        inet_pton(AF_INET, opt.ip.c_str(), &a.sin_addr);
+        return a;
+    }
+
+    void open_udp(int i){
+        Client& c = clients[i];
+        c.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        sockaddr_in a = server_addr();
+        connect(c.fd, (sockaddr*)&a, sizeof(a));
+        watch(i, EPOLLIN, true);
+    }
+
+    void udp_send(Client& c, uint8_t type, const void* p, size_t len){
+        char buf[65536];
+        UdpPacketHeader* h = (UdpPacketHeader*)buf;
+        memcpy(h->cid, c.cid, 9);
+        h->type = type;
+        memcpy(buf + sizeof(UdpPacketHeader), p, len);
+        (void)!send(c.fd, buf, sizeof(UdpPacketHeader) + len, 0);
+    }
+
+    // Header, every chunk of the graph, then FIN.
+    void udp_upload(Client& c){
+        const Graph& g = *c.g;
+        int32_t hdr[5] = {(int32_t)htonl(g.n), (int32_t)htonl(g.m), (int32_t)htonl(c.S),
+                          (int32_t)htonl(c.T), (int32_t)htonl(opt.encoding)};
+        udp_send(c, UDP_HEADER, hdr, sizeof(hdr));
+
+        int units = (int)(g.units.size() / g.unit_ints);
+        size_t fixed = sizeof(UdpPacketHeader) + 16;
+        int per = max<int>(1, (opt.mtu - 28 - fixed) / (4 * g.unit_ints));
+        int chunks = (units + per - 1) / per;
+        vector<int32_t> buf;
+        for(int k=0;k<chunks;k++){
+            int first = k * per, count = min(per, units - first);
+            buf.assign({(int32_t)htonl(k), (int32_t)htonl(chunks),
+                        (int32_t)htonl(first), (int32_t)htonl(count)});
+            buf.insert(buf.end(), g.units.begin() + (size_t)first * g.unit_ints,
+                       g.units.begin() + (size_t)(first + count) * g.unit_ints);
+            udp_send(c, UDP_CHUNK, buf.data(), buf.size() * 4);
+        }
+        udp_send(c, UDP_FIN, nullptr, 0);
+    }
+
+    void udp_start(int i){
+        Client& c = clients[i];
+        uint64_t id = next_cid++;
+        snprintf(c.cid, sizeof(c.cid), "%08llX", (unsigned long long)(id & 0xffffffffULL));
+        c.tries = 0;
+        c.st = C_WAIT_ACK;
+        udp_upload(c);
+    }
+
+    void on_datagrams(int i){
+        Client& c = clients[i];
+        char buf[65536];
+        while(true){
+            ssize_t r = recv(c.fd, buf, sizeof(buf), 0);
+            if(r < 0) return;
+            if(r < (ssize_t)sizeof(UdpPacketHeader) || memcmp(buf, c.cid, 8) != 0) continue;
+            if(c.st != C_WAIT_ACK && c.st != C_WAIT_RESULT) continue;   // stale
+
+            if(buf[8] == ' '){                     // "<cid> ERROR ..."
+                finish(i, DONE_ERROR);
+                continue;
+            }
+            uint8_t type = ((UdpPacketHeader*)buf)->type;
+            if(type == UDP_ACK) c.st = C_WAIT_RESULT;
+            else if(type == UDP_NACK){             // resend it all; uploads are small
+                totals.retransmits++;
+                udp_upload(c);
+            }
+            else if(type == UDP_RESULT) finish(i, DONE_OK);
+            else if(type == UDP_BUSY && r >= (ssize_t)sizeof(UdpPacketHeader) + 4){
+                int32_t ms;
+                memcpy(&ms, buf + sizeof(UdpPacketHeader), 4);
+                finish(i, DONE_BUSY, ntohl(ms));
+            }
+        }
+    }
+};
+
+/*==========================================================================
+ * MAIN
+ *==========================================================================*/
+
+int main(int argc, char** argv){
+    if(!parse_options(argc, argv)){
+        usage();
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    mt19937_64 rng(opt.seed);
+    for(int k=0;k<opt.graphs;k++) graphs.push_back(make_graph(opt.n, opt.m, rng));
+
+    const char* enc[] = {"matrix", "edges", "varint"};
+    cout<<"loadgen: "<<(opt.udp ? "UDP" : "TCP")<<" "<<opt.ip<<":"<<opt.port
+        <<", "<<opt.conns<<" clients on "<<opt.threads<<" threads, "
+        <<(opt.rate > 0 ? to_string((long)opt.rate) + " req/s open loop" : string("closed loop"))
+        <<", graphs n="<<opt.n<<" m="<<opt.m<<" ("<<enc[opt.encoding]<<")"
+        <<(!opt.udp && opt.reconnect ? ", new connection per request" : "")<<"\n";
+
+    auto start   = Clock::now() + chrono::milliseconds(50);
+    auto measure = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(opt.warmup));
+    auto end     = measure + chrono::duration_cast<Clock::duration>(chrono::duration<double>(opt.duration));
+
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    int base = 0;
+    for(int t=0;t<opt.threads;t++){
+        int count = opt.conns / opt.threads + (t < opt.conns % opt.threads);
+        workers.push_back(make_unique<Worker>(base, count));
+        base += count;
+    }
+    for(auto& w : workers)
+        threads.emplace_back([&w, start, measure, end](){ w->run(start, measure, end); });
+    for(auto& t : threads) t.join();
+
+    Totals all;
+    for(auto& w : workers){
+        all.hist.merge(w->totals.hist);
+        all.ok += w->totals.ok;
+        all.errors += w->totals.errors;
+        all.timeouts += w->totals.timeouts;
+        all.busy += w->totals.busy;
+        all.retransmits += w->totals.retransmits;
+        all.late += w->totals.late;
+    }
+
+    auto us = [&](uint64_t ns){ return ns / 1000.0; };
+    printf("requests: %llu ok, %llu errors, %llu timeouts, %llu busy in %.1f s\n",
+           (unsigned long long)all.ok, (unsigned long long)all.errors,
+           (unsigned long long)all.timeouts, (unsigned long long)all.busy, opt.duration);
+    printf("throughput: %.1f req/s\n", all.ok / opt.duration);
+    if(opt.udp) printf("retransmissions: %llu\n", (unsigned long long)all.retransmits);
+    if(opt.rate > 0) printf("sent late (>1 ms behind schedule): %llu\n", (unsigned long long)all.late);
+    printf("latency (us): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  mean %.1f\n",
+           us(all.hist.min_ns()), us(all.hist.percentile(50)), us(all.hist.percentile(90)),
+           us(all.hist.percentile(99)), us(all.hist.percentile(99.9)), us(all.hist.max_ns()),
+           all.hist.mean_ns() / 1000.0);
+    return all.ok ? 0 : 1;
+}
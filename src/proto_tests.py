@@ -0,0 +1,418 @@
+# proto_tests.py - protocol v2 and UDP checks for run_tests.sh
+#
+# Usage: python3 proto_tests.py <IP> <PORT> <case>
+# Prints what went wrong and exits 1 on failure; exits 0 on success.
+
+import heapq, random, socket, struct, sys, threading, time
+
+IP, PORT, CASE = sys.argv[1], int(sys.argv[2]), sys.argv[3]
+
+# same graph as test_data/simple.txt: 0 -> 5 is 0-2-3-4-5, length 10
+N, S, T = 6, 0, 5
+E = [(0,1,5), (0,2,3), (1,2,2), (1,3,7), (2,3,1), (3,4,4), (4,5,2)]
+M = len(E)
+DIST, PATH = 10, [0, 2, 3, 4, 5]
+
+PROTO_V2 = 2
+ENC_MATRIX, ENC_EDGES, ENC_VARINT = 0, 1, 2
+SEARCH_DIJKSTRA, SEARCH_BIDIR, SEARCH_ALT = 1, 2, 3
+KEEPALIVE = 1 << 16
+OP_SOLVE, OP_UPLOAD, OP_QUERY, OP_RELEASE, OP_BATCH, OP_STATS = range(6)
+PATHS = 1 << 17
+ERR_BUSY = 2
+UDP_HEADER, UDP_ROW, UDP_WEIGHTS, UDP_FIN, UDP_ACK, UDP_RESULT, UDP_EDGES = range(1, 8)
+UDP_NACK, UDP_CHUNK, UDP_BUSY = 8, 9, 10
+
+class Fail(Exception):
+    pass
+
+def check(cond, what):
+    if not cond:
+        raise Fail(what)
+
+# ---------------- TCP (v2) ----------------
+
+def payload(enc=ENC_MATRIX, n=N, edges=E):
+    if enc == ENC_EDGES:
+        return b''.join(struct.pack('<3i', *e) for e in edges)
+    if enc == ENC_MATRIX:
+        m = len(edges)
+        mat = [0] * (n * m)
+        for j, (u, v, w) in enumerate(edges):
+            mat[u*m + j] = w
+            mat[v*m + j] = -w
+        return struct.pack('<%di' % (n*m + m), *(mat + [w for _, _, w in edges]))
+    out, prev = bytearray(), 0
+    def varint(x):
+        while x >= 0x80:
+            out.append(x & 0x7f | 0x80)
+            x >>= 7
+        out.append(x)
+    zigzag = lambda x: x * 2 if x >= 0 else -x * 2 - 1
+    for u, v, w in edges:
+        varint(zigzag(u - prev)); varint(zigzag(v - u)); varint(w)
+        prev = u
+    return struct.pack('<Q', len(out)) + bytes(out)
+
+def enc(e):
+    return e << 8
+
+def search(a):
+    return a << 12
+
+def op(o):
+    return o << 20
+
+# bits: extra GraphRequest.reserved bits on top of the version
+def request(n, m, s, t, bits=0, rid=1, body=b''):
+    reserved = PROTO_V2 | bits
+    return struct.pack('<5i', 0, 0, 0, 0, reserved) + struct.pack('<5Q', n, m, s, t, rid) + body
+
+def connect():
+    c = socket.create_connection((IP, PORT), timeout=5)
+    return c, c.makefile('rb')
+
+def response(f):
+    h = f.read(40)
+    check(len(h) == 40, 'connection closed before the response')
+    body_len, rid, ec, msg_len, dist, path_size = struct.unpack('<QQiIqQ', h)
+    body = f.read(body_len)
+    check(len(body) == body_len, 'short response body')
+    path = list(struct.unpack('<%dq' % path_size, body[msg_len:msg_len + 8*path_size]))
+    return {'rid': rid, 'ec': ec, 'msg': body[:msg_len].decode(), 'dist': dist,
+            'path': path, 'extra': body[msg_len + 8*path_size:]}
+
+def exchange(req):
+    c, f = connect()
+    c.sendall(req)
+    r = response(f)
+    c.close()
+    return r
+
+def solve(e=ENC_MATRIX):
+    return exchange(request(N, M, S, T, enc(e), body=payload(e)))
+
+def server_alive():
+    r = solve()
+    check(r['ec'] == 0 and r['dist'] == DIST, 'server no longer answers: %s' % r['msg'])
+
+def case_v2():
+    r = exchange(request(N, M, S, T, rid=77, body=payload()))
+    check(r['ec'] == 0, r['msg'])
+    check(r['rid'] == 77, 'request_id not echoed: %d' % r['rid'])
+    check(r['dist'] == DIST and r['path'] == PATH, 'path %s, length %d' % (r['path'], r['dist']))
+
+def case_encodings():
+    for e in (ENC_MATRIX, ENC_EDGES, ENC_VARINT):
+        r = solve(e)
+        check(r['ec'] == 0 and r['dist'] == DIST, 'encoding %d: %s' % (e, r['msg']))
+
+def grid(side, seed):
+    rnd = random.Random(seed)
+    edges = []
+    for v in range(side * side):
+        if v % side + 1 < side:
+            edges.append((v, v + 1, rnd.randint(1, 20)))
+        if v + side < side * side:
+            edges.append((v, v + side, rnd.randint(1, 20)))
+    return edges
+
+def dijkstra(n, edges, s):
+    adj = [[] for _ in range(n)]
+    for u, v, w in edges:
+        adj[u].append((v, w)); adj[v].append((u, w))
+    d, pq = [None] * n, [(0, s)]
+    while pq:
+        du, u = heapq.heappop(pq)
+        if d[u] is not None:
+            continue
+        d[u] = du
+        for v, w in adj[u]:
+            if d[v] is None:
+                heapq.heappush(pq, (du + w, v))
+    return d
+
+def check_path(edges, r, s, t):
+    w = {}
+    for u, v, x in edges:
+        w[u, v] = w[v, u] = min(x, w.get((u, v), x))
+    p = r['path']
+    check(p and p[0] == s and p[-1] == t, 'path %d -> %d is %s' % (s, t, p))
+    check(sum(w.get(e, 10**9) for e in zip(p, p[1:])) == r['dist'],
+          'path %d -> %d does not add up to %d' % (s, t, r['dist']))
+
+def case_search():
+    # every algorithm must find a shortest path, not just any path
+    side = 20
+    n, edges = side * side, grid(side, 7)
+    pairs = [(0, n - 1), (n - 1, 0), (17, 250), (side - 1, n - side)]
+    ref = {s: dijkstra(n, edges, s) for s, _ in pairs}
+    for a in (SEARCH_DIJKSTRA, SEARCH_BIDIR, SEARCH_ALT):
+        for s, t in pairs:
+            r = exchange(request(n, len(edges), s, t, enc(ENC_EDGES) | search(a),
+                                 body=payload(ENC_EDGES, n, edges)))
+            check(r['ec'] == 0, 'search %d: %s' % (a, r['msg']))
+            check(r['dist'] == ref[s][t], 'search %d, %d -> %d: %d instead of %d'
+                  % (a, s, t, r['dist'], ref[s][t]))
+            check_path(edges, r, s, t)
+    # landmarks exist only for registered graphs: this is where ALT runs
+    c, f = connect()
+    c.sendall(request(n, len(edges), 0, 0, enc(ENC_EDGES) | op(OP_UPLOAD) | KEEPALIVE,
+                      body=payload(ENC_EDGES, n, edges)))
+    r = response(f)
+    check(r['ec'] == 0, 'upload: %s' % r['msg'])
+    h = r['extra']
+    for s, t in pairs:
+        c.sendall(request(0, 0, s, t, op(OP_QUERY) | search(SEARCH_ALT) | KEEPALIVE, body=h))
+        r = response(f)
+        check(r['ec'] == 0 and r['dist'] == ref[s][t], 'ALT query %d -> %d: %s, %d instead of %d'
+              % (s, t, r['msg'], r['dist'], ref[s][t]))
+        check_path(edges, r, s, t)
+    c.close()
+
+def case_keepalive():
+    c, f = connect()
+    reqs = b''.join(request(N, M, S, t, KEEPALIVE, rid=100 + t, body=payload()) for t in (5, 3, 4))
+    c.sendall(reqs)   # pipelined: all three before any response
+    got = {}
+    for _ in range(3):
+        r = response(f)
+        check(r['ec'] == 0, r['msg'])
+        got[r['rid']] = r['dist']
+    check(got == {105: 10, 103: 4, 104: 8}, 'responses %s' % got)
+    c.sendall(request(N, M, S, T, KEEPALIVE, rid=9, body=payload()))
+    r = response(f)
+    check(r['rid'] == 9 and r['dist'] == DIST, 'connection not kept alive')
+    c.close()
+
+def case_registry():
+    c, f = connect()
+    c.sendall(request(N, M, 0, 0, enc(ENC_EDGES) | op(OP_UPLOAD) | KEEPALIVE, body=payload(ENC_EDGES)))
+    r = response(f)
+    check(r['ec'] == 0 and len(r['extra']) == 8, 'upload: %s' % r['msg'])
+    h = r['extra']
+    c.sendall(request(N, M, 0, 0, op(OP_UPLOAD) | KEEPALIVE, body=payload()))
+    check(response(f)['extra'] == h, 'same graph, different handle')
+    for a in (0, SEARCH_ALT):
+        for t, d in ((5, 10), (1, 5)):
+            c.sendall(request(0, 0, S, t, op(OP_QUERY) | search(a) | KEEPALIVE, body=h))
+            r = response(f)
+            check(r['ec'] == 0 and r['dist'] == d, 'query %d: %s' % (t, r['msg']))
+    for _ in range(2):   # one per upload
+        c.sendall(request(0, 0, 0, 0, op(OP_RELEASE) | KEEPALIVE, body=h))
+        check(response(f)['ec'] == 0, 'release failed')
+    c.sendall(request(0, 0, S, T, op(OP_QUERY) | KEEPALIVE, body=h))
+    r = response(f)
+    check(r['ec'] == 1 and 'Unknown' in r['msg'], 'query after release: %s' % r['msg'])
+    c.close()
+
+def batch(n, edges, srcs, tgts, flags=0):
+    ids = struct.pack('<%dq' % (len(srcs) + len(tgts)), *(srcs + tgts))
+    return exchange(request(n, len(edges), len(srcs), len(tgts), enc(ENC_EDGES) | op(OP_BATCH) | flags,
+                            body=payload(ENC_EDGES, n, edges) + ids))
+
+def case_batch():
+    srcs, tgts = [0, 5, 0], [5, 1, 3]
+    r = batch(N, E, srcs, tgts, PATHS)
+    check(r['ec'] == 0, r['msg'])
+    k = len(srcs) * len(tgts)
+    table = list(struct.unpack('<%dq' % k, r['extra'][:8*k]))
+    check(table == [10, 5, 4, 0, 9, 6, 10, 5, 4], 'table %s' % table)
+    off = 8*k
+    first = struct.unpack('<Q', r['extra'][off:off+8])[0]
+    path = list(struct.unpack('<%dq' % first, r['extra'][off+8:off+8+8*first]))
+    check(path == PATH, 'first path %s' % path)
+
+def case_batch_limit():
+    # 60 x 60 paths of ~2000 vertices: far over a 1 MB --max-payload
+    n = 2000
+    line = [(i, i + 1, 1) for i in range(n - 1)]
+    r = batch(n, line, list(range(60)), list(range(n - 60, n)), PATHS)
+    check(r['ec'] == 1 and 'too large' in r['msg'], 'batch over the limit: %s' % r['msg'])
+    r = batch(n, line, [0], [n - 1], PATHS)
+    check(r['ec'] == 0, 'small batch: %s' % r['msg'])
+
+def case_stats():
+    r = exchange(request(0, 0, 0, 0, op(OP_STATS)))
+    check(r['ec'] == 0 and 'graph_server_requests_total' in r['msg'], 'stats: %s' % r['msg'][:80])
+
+def case_busy():
+    # run against a server started with --rate-limit QPS --rate-burst 1, QPS <= 1
+    c, f = connect()
+    results = []
+    for rid in (1, 2):
+        c.sendall(request(N, M, S, T, KEEPALIVE, rid=rid, body=payload()))
+        results.append(response(f))
+    check(results[0]['ec'] == 0, 'first request refused: %s' % results[0]['msg'])
+    busy = results[1]
+    check(busy['ec'] == ERR_BUSY and busy['dist'] > 0, 'second request: %s' % busy['msg'])
+    # the refused payload was skipped: the connection is still usable
+    time.sleep(busy['dist'] / 1000 + 0.05)
+    c.sendall(request(N, M, S, T, KEEPALIVE, rid=3, body=payload()))
+    r = response(f)
+    check(r['ec'] == 0 and r['rid'] == 3, 'after waiting: %s' % r['msg'])
+    c.close()
+
+    u = udp(b'7e570b05')
+    u.send(udp_header(u, N, M, ENC_EDGES))
+    t, data = udp_recv(u)
+    check(t == UDP_BUSY and struct.unpack('!i', data[:4])[0] > 0, 'UDP header not refused')
+
+def case_malformed():
+    big = 2**31 - 1
+    bad = [('matrix n', request(big, 0, 0, 1)),
+           ('edges n',  request(big, 1, 0, 1, enc(ENC_EDGES), body=struct.pack('<3i', 0, 1, 1))),
+           ('varint m', request(10, big, 0, 1, enc(ENC_VARINT), body=struct.pack('<Q', 1) + b'\0')),
+           ('varint m, small header', request(10, 80000000, 0, 1, enc(ENC_VARINT),
+                                              body=struct.pack('<Q', 1) + b'\0')),
+           ('varint delta', request(10, 1, 0, 1, enc(ENC_VARINT),   # zigzag delta 2^64-1
+                                    body=struct.pack('<Q', 12) + b'\xff' * 9 + b'\x01\0\x01'))]
+    for what, req in bad:
+        r = exchange(req)
+        check(r['ec'] == 1, '%s accepted: %s' % (what, r['msg']))
+    server_alive()
+
+# ---------------- UDP ----------------
+
+class Udp(socket.socket):
+    cid = b''
+
+# each case uses its own session id, so no case sees another's session
+def udp(cid):
+    u = Udp(socket.AF_INET, socket.SOCK_DGRAM)
+    u.connect((IP, PORT))
+    u.settimeout(2)
+    u.cid = cid
+    return u
+
+def udp_packet(u, t, data=b''):
+    return u.cid + b'\0' + bytes([t]) + data
+
+def udp_header(u, n, m, e):
+    return udp_packet(u, UDP_HEADER, struct.pack('!5i', n, m, S, T, e))
+
+def udp_edges(u, first, edges):
+    units = [x for e in edges for x in e]
+    return udp_packet(u, UDP_EDGES, struct.pack('!2i', first, len(edges)) +
+                      struct.pack('!%di' % len(units), *units))
+
+def udp_recv(u, text_ok=False):
+    d = u.recv(65536)
+    check(d[:8] == u.cid, 'reply for another session: %r' % d)
+    check(text_ok or b' ERROR ' not in d, 'server replied %r' % d)
+    return d[9], d[10:]
+
+def udp_result(u, ack=False):
+    # the ACK comes from the receiver and the result from a worker: either
+    # may arrive first. With ack, wait for both so none is left queued.
+    t, data = udp_recv(u)
+    if t == UDP_ACK:
+        t, data = udp_recv(u)
+    elif ack and t == UDP_RESULT:
+        a, _ = udp_recv(u)
+        check(a == UDP_ACK, 'expected an ACK, got type %d' % a)
+    check(t == UDP_RESULT, 'expected a result, got type %d' % t)
+    dist, size = struct.unpack('!2i', data[:8])
+    path = list(struct.unpack('!%di' % size, data[8:8 + 4*size]))
+    check(dist == DIST and path == PATH, 'UDP path %s, length %d' % (path, dist))
+
+def matrix_rows():
+    m = payload(ENC_MATRIX)
+    ints = struct.unpack('<%di' % (N*M + M), m)
+    return [ints[r*M:(r+1)*M] for r in range(N + 1)]   # row N = weights
+
+def case_udp_nack():
+    u = udp(b'7e570a01')
+    rows = matrix_rows()
+    u.send(udp_header(u, N, M, ENC_MATRIX))
+    for r in (0, 1, 3, 4):   # rows 2 and 5 and the weights are "lost"
+        u.send(udp_packet(u, UDP_ROW, struct.pack('!i', r) + struct.pack('!%di' % M, *rows[r])))
+    u.send(udp_packet(u, UDP_FIN))
+    t, data = udp_recv(u)
+    check(t == UDP_NACK, 'expected a NACK, got type %d' % t)
+    header_missing, weights_missing, first, count = struct.unpack('!4i', data[:16])
+    bits = int.from_bytes(data[16:16 + (count + 7)//8], 'little')
+    missing = [first + i for i in range(count) if bits >> i & 1]
+    check(not header_missing and weights_missing and missing == [2, 5],
+          'NACK lists %s, weights %d' % (missing, weights_missing))
+    for r in missing:
+        u.send(udp_packet(u, UDP_ROW, struct.pack('!i', r) + struct.pack('!%di' % M, *rows[r])))
+    u.send(udp_packet(u, UDP_WEIGHTS, struct.pack('!i', M) + struct.pack('!%di' % M, *rows[N])))
+    u.send(udp_packet(u, UDP_FIN))
+    udp_result(u)
+
+def case_udp_expire():
+    # run against a server started with --udp-timeout 1: a complete upload
+    # left idle is dropped by the timer wheel, so its FIN finds nothing
+    u = udp(b'7e570a02')
+    u.send(udp_header(u, N, M, ENC_EDGES))
+    u.send(udp_edges(u, 0, E))
+    time.sleep(2.5)
+    u.send(udp_packet(u, UDP_FIN))
+    t, data = udp_recv(u)
+    check(t == UDP_NACK and struct.unpack('!i', data[:4])[0] == 1,
+          'idle session kept: type %d' % t)
+
+def case_udp_chunk():
+    u = udp(b'7e570a03')
+    u.send(udp_header(u, N, M, ENC_EDGES))
+    # two chunks, second one first
+    chunks = [(0, 0, 4), (1, 4, 3)]
+    for seq, first, count in reversed(chunks):
+        units = [x for e in E[first:first + count] for x in e]
+        u.send(udp_packet(u, UDP_CHUNK, struct.pack('!4i', seq, 2, first, count) +
+                          struct.pack('!%di' % len(units), *units)))
+    u.send(udp_packet(u, UDP_FIN))
+    udp_result(u)
+
+def case_udp_many():
+    # many sessions at once, from as many sockets: with --udp-threads and
+    # SO_REUSEPORT they land on different receivers
+    errors = []
+    def one(i):
+        try:
+            u = udp(b'7e57%04x' % i)
+            u.send(udp_header(u, N, M, ENC_EDGES))
+            u.send(udp_edges(u, 0, E))
+            u.send(udp_packet(u, UDP_FIN))
+            udp_result(u)
+        except (Fail, OSError) as e:
+            errors.append('session %d: %s' % (i, e))
+    threads = [threading.Thread(target=one, args=(i,)) for i in range(32)]
+    for th in threads: th.start()
+    for th in threads: th.join()
+    check(not errors, '; '.join(errors[:3]))
+
+def case_udp_late_fin():
+    # a FIN resent after the session was solved gets the same result back,
+    # not a NACK that would make the client upload everything again
+    u = udp(b'7e570a05')
+    u.send(udp_header(u, N, M, ENC_EDGES))
+    u.send(udp_edges(u, 0, E))
+    u.send(udp_packet(u, UDP_FIN))
+    udp_result(u, ack=True)
+    u.send(udp_packet(u, UDP_FIN))
+    udp_result(u, ack=True)
+
+    # a FIN for a session never opened asks for the header
+    u = udp(b'7e570a06')
+    u.send(udp_packet(u, UDP_FIN))
+    t, data = udp_recv(u)
+    check(t == UDP_NACK and struct.unpack('!i', data[:4])[0] == 1, 'unknown session: type %d' % t)
+
+def case_udp_short():
+    u = udp(b'7e570a04')
+    u.send(udp_packet(u, UDP_HEADER, struct.pack('!i', N)))   # n only
+    try:
+        d = u.recv(65536)
+        raise Fail('short header answered: %r' % d)
+    except socket.timeout:
+        pass
+    server_alive()
+
+try:
+    globals()['case_' + CASE]()
+except (Fail, OSError, struct.error) as e:
+    print('%s: %s' % (CASE, e))
+    sys.exit(1)
+print('%s: OK' % CASE)
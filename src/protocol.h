@@ -11,18 +11,122 @@ struct GraphRequest {
     int32_t edges;
     int32_t start_node;
     int32_t end_node;
-    int32_t reserved; // future flags
+    int32_t reserved; // protocol version + flags, see below
 };
 
+// GraphRequest.reserved layout:
+//   bits 0-7  protocol version (0 or 1 = v1, 2 = v2)
+//   bits 8-11 payload encoding (ENC_*), valid with either version
+//   bits 12-15 search algorithm (SEARCH_*), valid with either version
+//   bit  16   FLAG_KEEPALIVE (v2 only): keep the connection open for more
+//             requests; responses may arrive out of order, matched by
+//             GraphResponseV2.request_id
+//   bit  17   FLAG_PATHS (OP_BATCH): also return the path of every pair
+//   bits 20-23 operation (OP_*), v2 only
+const int32_t PROTO_V1 = 1;
+const int32_t PROTO_V2 = 2;
+const int32_t FLAG_KEEPALIVE = 1 << 16;
+const int32_t FLAG_PATHS     = 1 << 17;
+
+// Payload encodings. Each edge e of the incidence matrix is the column
+// with +w at u and -w at v; the edge-list forms send (u, v, w) directly.
+const int32_t ENC_MATRIX = 0;  // n*m int32 matrix + m int32 weights
+const int32_t ENC_EDGES  = 1;  // m x (int32 u, int32 v, int32 w)
+const int32_t ENC_VARINT = 2;  // uint64 byte count, then m x varints:
+                               //   zigzag(u - previous u), zigzag(v - u), w
+
+// Search algorithms. All return the same shortest distance and a
+// shortest path; they differ in how much of the graph they explore.
+const int32_t SEARCH_DEFAULT  = 0;  // server's --search setting
+const int32_t SEARCH_DIJKSTRA = 1;
+const int32_t SEARCH_BIDIR    = 2;  // bidirectional Dijkstra
+const int32_t SEARCH_ALT      = 3;  // A* with landmark lower bounds
+// ALT only pays off once its landmarks are built, which costs several
+// full searches. Landmarks exist only for graphs registered with
+// OP_UPLOAD, so OP_QUERY runs ALT; OP_SOLVE, OP_BATCH and UDP requests
+// asking for ALT get bidirectional Dijkstra instead.
+
+// Operations (v2). Registered graphs are identified by a 64-bit handle
+// derived from their content; uploading the same graph twice returns the
+// same handle while it stays registered. Handles are only meaningful to
+// the server process that issued them. Each UPLOAD takes a reference owned by its connection,
+// dropped by RELEASE or when the connection closes; a graph is evicted
+// once no reference is left.
+const int32_t OP_SOLVE   = 0;  // graph payload + S/T -> path
+const int32_t OP_UPLOAD  = 1;  // graph payload -> handle; S/T ignored
+const int32_t OP_QUERY   = 2;  // uint64 handle + S/T -> path; n/m ignored
+const int32_t OP_RELEASE = 3;  // uint64 handle; n/m/S/T ignored
+const int32_t OP_BATCH   = 4;  // graph payload, then start_node int64 sources
+                               // and end_node int64 targets -> distance table
+const int32_t OP_STATS   = 5;  // no payload -> server metrics as Prometheus
+                               // text in the message; n/m/S/T ignored
+
+inline int32_t proto_version(int32_t reserved){
+    int32_t v = reserved & 0xff;
+    return v == 0 ? PROTO_V1 : v;
+}
+
+inline int32_t proto_encoding(int32_t reserved){
+    return (reserved >> 8) & 0xf;
+}
+
+inline int32_t proto_search(int32_t reserved){
+    return (reserved >> 12) & 0xf;
+}
+
+inline int32_t proto_op(int32_t reserved){
+    return (reserved >> 20) & 0xf;
+}
+
+inline int32_t make_reserved(int32_t version, int32_t encoding,
+                             int32_t search = SEARCH_DEFAULT, int32_t op = OP_SOLVE){
+    return version | (encoding << 8) | (search << 12) | (op << 20);
+}
+
+// error_code of a refused request: the server is overloaded or the
+// client's rate limit is spent. The response carries the suggested wait
+// before retrying, in milliseconds, in path_length (v1) or distance (v2).
+// The server may answer as soon as it has the header; the rest of the
+// request is still read (and discarded) before the next one.
+const int32_t ERR_BUSY = 2;
+
 // Binary TCP response (server -> client)
 struct GraphResponse {
-    int32_t error_code;    // 0 = ok, 1 = error
-    int32_t path_length;   // total weight or -1 if error
+    int32_t error_code;    // 0 = ok, 1 = error, ERR_BUSY
+    int32_t path_length;   // total weight, retry-after ms if busy, or -1
     int32_t path_size;     // number of vertices in path
     char message[128];     // null-terminated message
     int32_t path[64];      // up to 64 nodes (safe guard)
 };
 
+// Protocol v2 (TCP), selected with GraphRequest.reserved = PROTO_V2.
+// The GraphRequest counts are ignored; GraphRequestV2 follows it, then
+// the payload in the requested encoding, exactly as in v1.
+// All v2 fields use host byte order like the v1 structs.
+struct GraphRequestV2 {
+    uint64_t vertices;
+    uint64_t edges;
+    uint64_t start_node;
+    uint64_t end_node;
+    uint64_t request_id;   // echoed in GraphResponseV2
+};
+
+// v2 response header, followed by body_len bytes:
+//   message (message_len bytes, not null-terminated)
+//   path    (path_size int64 vertex ids)
+//   uint64 handle, for a successful OP_UPLOAD only
+//   for a successful OP_BATCH: sources x targets int64 distances, row per
+//   source (-1 = no path); with FLAG_PATHS, then for every pair in the
+//   same order a uint64 vertex count and that many int64 vertex ids
+struct GraphResponseV2 {
+    uint64_t body_len;
+    uint64_t request_id;
+    int32_t  error_code;   // 0 = ok, 1 = error, ERR_BUSY
+    uint32_t message_len;
+    int64_t  distance;     // total weight, retry-after ms if busy, or -1
+    uint64_t path_size;
+};
+
 // UDP packet types
 enum UdpType : uint8_t {
     UDP_HEADER = 1,
@@ -30,8 +134,30 @@ enum UdpType : uint8_t {
     UDP_WEIGHTS = 3,
     UDP_FIN = 4,
     UDP_ACK = 5,
-    UDP_RESULT = 6
+    UDP_RESULT = 6,
+    UDP_EDGES = 7,    // int32 first edge, int32 count, count x (u, v, w)
+    UDP_NACK = 8,     // server -> client, answers UDP_FIN while data is missing
+    UDP_CHUNK = 9,    // int32 seq, int32 total, int32 first, int32 count, units
+    UDP_BUSY = 10     // server -> client: int32 retry-after ms
 };
+// UDP_BUSY answers a UDP_HEADER or UDP_FIN the server will not take on,
+// because it is overloaded or the client's rate limit is spent. The
+// session is dropped: the client waits retry-after ms, then uploads
+// everything again.
+// UDP_NACK payload: int32 header_missing (resend everything),
+// int32 weights_missing, int32 first, int32 count, then a bitmap of
+// count bits (LSB first): bit i set = unit first+i is missing. Units are
+// rows for ENC_MATRIX sessions and edges for ENC_EDGES. The client
+// resends what is listed and then UDP_FIN again.
+// UDP_CHUNK packs count consecutive units, starting at unit first, into
+// one datagram sized to the sender's MTU. Matrix units are rows of m
+// int32, with unit n being the weights; edge units are (u, v, w). seq is
+// the chunk's index among total chunks of the upload; a chunk always
+// covers the same units, so resends reuse its seq. Chunks may arrive in
+// any order and are written straight to their place in the session.
+// UDP_HEADER payload: int32 n, m, S, T and an optional int32 encoding
+// (ENC_MATRIX when absent). ENC_EDGES sessions send UDP_EDGES instead of
+// UDP_ROW + UDP_WEIGHTS. All UDP integers are in network byte order.
 
 // Binary UDP header (fixed)
 struct UdpPacketHeader {
@@ -43,3 +169,24 @@ struct UdpPacketHeader {
 #ifdef _MSC_VER
 #pragma pack(pop)
 #endif
+
+// LEB128 varints used by ENC_VARINT.
+inline uint64_t zigzag(int64_t x){ return ((uint64_t)x << 1) ^ (uint64_t)(x >> 63); }
+inline int64_t unzigzag(uint64_t x){ return (int64_t)(x >> 1) ^ -(int64_t)(x & 1); }
+
+inline uint8_t* put_varint(uint8_t* p, uint64_t x){
+    while(x >= 0x80){ *p++ = (uint8_t)(x | 0x80); x >>= 7; }
+    *p++ = (uint8_t)x;
+    return p;
+}
+
+// Returns nullptr on truncated or overlong input.
+inline const uint8_t* get_varint(const uint8_t* p, const uint8_t* end, uint64_t& x){
+    x = 0;
+    for(int shift = 0; p < end && shift < 64; shift += 7){
+        uint8_t b = *p++;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if(!(b & 0x80)) return p;
+    }
+    return nullptr;
+}
@@ -1,7 +1,7 @@
 #!/bin/bash
 # run_tests.sh - Tests conformes aux exigences 2.11
 
-set -e  # Arrêter en cas d'erreur
+# Pas de set -e : chaque test est compté, le rapport final donne le code de sortie
 
 echo "========================================"
 echo "TESTS CLIENT-SERVEUR - Exigences 2.11"
@@ -28,7 +28,7 @@ create_test_files() {
     
     # 2.11.3/2.11.4: Test simple
     cat > test_data/simple.txt << 'EOF'
-6 6
+6 7
 0 5
 0 1 5
 0 2 3
@@ -65,7 +65,7 @@ EOF
     
     # 2.11.5: n=19 (MAX si limite=20) - DEVRAIT RÉUSSIR
     cat > test_data/n19.txt << 'EOF'
-19 10
+19 18
 0 18
 0 1 1
 1 2 2
@@ -101,7 +101,7 @@ EOF
     
     # 2.11.6: Milieu OДЗ (n=12)
     cat > test_data/middle.txt << 'EOF'
-12 10
+12 11
 0 11
 0 1 3
 1 2 4
@@ -127,7 +127,7 @@ run_test() {
     local test_file=$4     # fichier ou "keyboard_input"
     local expected_result=$5  # "success" ou "failure"
     
-    ((TOTAL++))
+    TOTAL=$((TOTAL + 1))
     echo -e "\n🔧 Test $TOTAL: $test_name"
     echo "   Protocole: $protocol, Méthode: $input_method"
     
@@ -145,7 +145,7 @@ EOF
         cat > input.tmp << EOF
 1
 6
-6
+7
 0
 5
 0 1 5
@@ -168,7 +168,7 @@ EOF
         result="timeout"
     elif grep -q "RESULT\|Path length:" "$output_file"; then
         result="success"
-    elif grep -q "ERROR\|error\|invalid\|Invalid" "$output_file"; then
+    elif grep -q "ERROR\|Error\|error\|invalid\|Invalid" "$output_file"; then
         result="failure"
     else
         result="unknown"
@@ -177,20 +177,20 @@ EOF
     # Vérifier si conforme aux attentes
     if [ "$result" = "$expected_result" ] || [ "$expected_result" = "any" ]; then
         echo "   ✅ SUCCÈS: Comportement attendu ($result)"
-        ((PASS++))
+        PASS=$((PASS + 1))
         return 0
     else
         echo "   ❌ ÉCHEC: Attendu $expected_result, obtenu $result"
         echo "   Sortie (dernières lignes):"
         tail -5 "$output_file" | sed 's/^/      /'
-        ((FAIL++))
+        FAIL=$((FAIL + 1))
         return 1
     fi
 }
 
 # Tester UDP avec serveur indisponible
 test_udp_no_server() {
-    ((TOTAL++))
+    TOTAL=$((TOTAL + 1))
     echo -e "\n🔧 Test $TOTAL: UDP avec serveur indisponible (2.11.2)"
     
     # Arrêter serveur si running
@@ -217,16 +217,50 @@ EOF
     # Le test réussit si le client détecte la perte de connexion
     if [ $exit_code -eq 124 ] || grep -q "Connection lost\|timeout\|Perte" logs/udp_no_server.log; then
         echo "   ✅ SUCCÈS: Client détecte serveur indisponible"
-        ((PASS++))
+        PASS=$((PASS + 1))
     else
         echo "   ❌ ÉCHEC: Client ne détecte pas serveur indisponible"
-        ((FAIL++))
+        FAIL=$((FAIL + 1))
     fi
     
     # Redémarrer serveur pour tests suivants
     start_server
 }
 
+# Test du protocole binaire (v2, UDP) via proto_tests.py
+# run_proto_test CAS [PORT] [NOM] : NOM distingue les passes d'un même cas
+run_proto_test() {
+    local case_name=$1
+    local port=${2:-$PORT}
+    local label=${3:-$case_name}
+
+    TOTAL=$((TOTAL + 1))
+    echo -e "\n🔧 Test $TOTAL: proto_$label"
+
+    local output_file="logs/proto_${label}.log"
+    if timeout 30 python3 proto_tests.py $SERVER_IP $port $case_name > "$output_file" 2>&1; then
+        echo "   ✅ SUCCÈS: $(tail -1 "$output_file")"
+        PASS=$((PASS + 1))
+    else
+        echo "   ❌ ÉCHEC: $(tail -1 "$output_file")"
+        FAIL=$((FAIL + 1))
+    fi
+}
+
+# Serveur dédié à des options particulières : start_extra PORT OPTIONS...
+start_extra() {
+    local port=$1
+    shift
+    ./server $port "$@" > logs/server_$port.log 2>&1 &
+    EXTRA_PID=$!
+    sleep 1
+}
+
+stop_extra() {
+    kill $EXTRA_PID 2>/dev/null || true
+    wait $EXTRA_PID 2>/dev/null || true
+}
+
 # Démarrer serveur
 start_server() {
     echo "Démarrage serveur sur port $PORT..."
@@ -313,22 +347,24 @@ echo -e "\n📋 Tests supplémentaires"
 
 # Test avec plusieurs clients (simultanés)
 echo -e "\n🔧 Test: 3 clients simultanés"
+CLIENT_PIDS=""
 for i in 1 2 3; do
     (timeout 10 ./client $SERVER_IP TCP $PORT << EOF
 2
 test_data/simple.txt
 EOF
     ) > logs/concurrent_$i.log 2>&1 &
+    CLIENT_PIDS="$CLIENT_PIDS $!"
 done
 
-# Attendre que tous terminent
-wait
+# Attendre que tous terminent (pas le serveur, lancé en arrière-plan lui aussi)
+wait $CLIENT_PIDS
 
 # Vérifier résultats
 concurrent_success=0
 for i in 1 2 3; do
     if grep -q "RESULT\|Path length:" logs/concurrent_$i.log; then
-        ((concurrent_success++))
+        concurrent_success=$((concurrent_success + 1))
     fi
 done
 
@@ -338,6 +374,65 @@ else
     echo "   ⚠️  3 clients simultanés: $concurrent_success/3 réussis"
 fi
 
+# ========================================
+# PROTOCOLE v2 ET UDP
+# ========================================
+echo -e "\n📋 Protocole v2 et UDP"
+
+run_proto_test "v2"            # en-tête v2, request_id, chemin
+run_proto_test "keepalive"     # FLAG_KEEPALIVE, requêtes en pipeline
+run_proto_test "encodings"     # ENC_MATRIX, ENC_EDGES, ENC_VARINT
+run_proto_test "search"        # SEARCH_DIJKSTRA, SEARCH_BIDIR, SEARCH_ALT (OP_QUERY)
+run_proto_test "registry"      # OP_UPLOAD, OP_QUERY (dont ALT), OP_RELEASE
+run_proto_test "batch"         # OP_BATCH avec FLAG_PATHS
+run_proto_test "stats"         # OP_STATS
+run_proto_test "udp_chunk"     # UDP_CHUNK dans le désordre
+run_proto_test "udp_nack"      # UDP_NACK puis renvoi des lignes manquantes
+run_proto_test "udp_late_fin"  # FIN répété après la réponse : même résultat
+run_proto_test "malformed"     # en-têtes v2 hors limites : refusés, serveur vivant
+run_proto_test "udp_short"     # UDP_HEADER tronqué : ignoré
+
+# Chaque file de priorité (--pq) sur son propre serveur
+for pq in binary dary radix; do
+    start_extra $((PORT + 3)) --pq $pq
+    run_proto_test "v2" $((PORT + 3)) "pq_$pq"
+    run_proto_test "search" $((PORT + 3)) "search_$pq"
+    stop_extra
+done
+
+# Petite limite de réponse
+start_extra $((PORT + 2)) --max-payload 1
+run_proto_test "batch_limit" $((PORT + 2))   # chemins de OP_BATCH au-delà de --max-payload
+stop_extra
+
+# Sessions UDP inactives expirées par la roue de temporisation
+start_extra $((PORT + 5)) --udp-timeout 1
+run_proto_test "udp_expire" $((PORT + 5))
+stop_extra
+
+# Plusieurs récepteurs UDP sur le même port (SO_REUSEPORT)
+start_extra $((PORT + 6)) --udp-threads 3
+run_proto_test "udp_many" $((PORT + 6)) "reuseport_many"
+run_proto_test "udp_chunk" $((PORT + 6)) "reuseport_chunk"
+stop_extra
+
+# Backend io_uring : mêmes cas TCP que ci-dessus
+start_extra $((PORT + 4)) --io uring
+for c in v2 keepalive encodings registry batch malformed; do
+    run_proto_test "$c" $((PORT + 4)) "uring_$c"
+done
+stop_extra
+
+# Limite de débit
+start_extra $((PORT + 1)) --rate-limit 1 --rate-burst 1
+run_proto_test "busy" $((PORT + 1))          # ERR_BUSY, UDP_BUSY, délai avant nouvel essai
+stop_extra
+
+# Débit fractionnaire : un jeton toutes les deux secondes
+start_extra $((PORT + 1)) --rate-limit 0.5 --rate-burst 1
+run_proto_test "busy" $((PORT + 1)) "busy_fractional"
+stop_extra
+
 # ========================================
 # NETTOYAGE ET RAPPORT
 # ========================================
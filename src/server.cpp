@@ -1,288 +1,2606 @@
 // server.cpp
-// Compile: g++ server.cpp -o server -std=c++17 -pthread
+// Compile: g++ server.cpp solver.cpp -o server -std=c++17 -pthread
 
 #include <bits/stdc++.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <atomic>
 #include <mutex>
 #include "protocol.h"
+#include "solver.h"
 using namespace std;
 
 /*==========================================================================
- * VALIDATION UTILITIES
+ * LOGGING (ASYNC RING BUFFER)
  *==========================================================================*/
 
-bool valid_nm(int n, int m){
-    return (n >= 6 && n < 20 && m >= 6 && m < 20);
+enum LogLevel { LL_TRACE, LL_DEBUG, LL_INFO, LL_WARN, LL_ERROR, LL_OFF };
+
+// Callers format into a slot of a bounded lock-free ring (one CAS claims
+// it) and return; a background thread writes published lines to stdout
+// in batches. A full ring drops lines and counts them rather than block
+// the caller.
+class Logger {
+public:
+    static constexpr size_t SLOTS    = 8192;   // power of two
+    static constexpr size_t LINE     = 240;
+    static constexpr int    FLUSH_MS = 20;
+
+    atomic<int> level{LL_INFO};
+    atomic<uint64_t> dropped{0};
+
+    Logger(){
+        for(size_t i=0;i<SLOTS;i++) ring[i].seq.store(i, memory_order_relaxed);
+    }
+
+    bool enabled(LogLevel l) const { return l >= level.load(memory_order_relaxed); }
+
+    __attribute__((format(printf, 3, 4)))
+    void log(LogLevel l, const char* fmt, ...){
+        size_t pos = head.load(memory_order_relaxed);
+        Slot* s;
+        while(true){
+            s = &ring[pos & (SLOTS - 1)];
+            size_t seq = s->seq.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if(diff == 0){
+                if(head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+            }
+            else if(diff < 0){   // full: the flusher is a whole ring behind
+                dropped++;
+                return;
+            }
+            else pos = head.load(memory_order_relaxed);
+        }
+
+        s->level = l;
+        s->time = chrono::system_clock::now();
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(s->text, LINE, fmt, ap);
+        va_end(ap);
+        s->seq.store(pos + 1, memory_order_release);
+    }
+
+    void start(){
+        thread([this](){
+            while(true){
+                this_thread::sleep_for(chrono::milliseconds(FLUSH_MS));
+                flush();
+            }
+        }).detach();
+    }
+
+    // Writes out every line published so far. Safe from any thread.
+    void flush(){
+        static const char* names[] = {"TRACE", "DEBUG", "INFO ", "WARN ", "ERROR"};
+        lock_guard<mutex> lk(drain_m);
+        string out;
+
+        while(true){
+            Slot& s = ring[tail & (SLOTS - 1)];
+            if(s.seq.load(memory_order_acquire) != tail + 1) break;
+
+            time_t t = chrono::system_clock::to_time_t(s.time);
+            int ms = chrono::duration_cast<chrono::milliseconds>(
+                         s.time.time_since_epoch()).count() % 1000;
+            tm lt;
+            localtime_r(&t, &lt);
+            char stamp[32];
+            snprintf(stamp, sizeof(stamp), "%02d:%02d:%02d.%03d %s ",
+                     lt.tm_hour, lt.tm_min, lt.tm_sec, ms, names[s.level]);
+            out += stamp;
+            out += s.text;
+            out += '\n';
+
+            s.seq.store(tail + SLOTS, memory_order_release);
+            tail++;
+        }
+
+        if(uint64_t d = dropped.exchange(0))
+            out += "WARN  log ring full, " + to_string(d) + " lines dropped\n";
+
+        for(size_t off = 0; off < out.size(); ){
+            ssize_t r = write(STDOUT_FILENO, out.data() + off, out.size() - off);
+            if(r < 0 && errno == EINTR) continue;
+            if(r <= 0) break;
+            off += r;
+        }
+    }
+
+private:
+    struct Slot {
+        atomic<size_t> seq;
+        int level;
+        chrono::system_clock::time_point time;
+        char text[LINE];
+    };
+    Slot ring[SLOTS];
+    alignas(64) atomic<size_t> head{0};
+    alignas(64) size_t tail = 0;     // flusher side, under drain_m
+    mutex drain_m;
+};
+
+Logger logger;
+
+bool parse_log_level(const string& s, int& out){
+    static const char* names[] = {"trace", "debug", "info", "warn", "error", "off"};
+    for(int i=0;i<=LL_OFF;i++)
+        if(s == names[i]){ out = i; return true; }
+    return false;
+}
+
+#define LOG(l, ...) do{ if(logger.enabled(l)) logger.log(l, __VA_ARGS__); }while(0)
+#define LOG_DEBUG(...) LOG(LL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)  LOG(LL_INFO,  __VA_ARGS__)
+#define LOG_WARN(...)  LOG(LL_WARN,  __VA_ARGS__)
+#define LOG_ERROR(...) LOG(LL_ERROR, __VA_ARGS__)
+
+// Per-packet traces; build with -DSERVER_NO_TRACE to compile them out.
+#ifdef SERVER_NO_TRACE
+#define LOG_TRACE(...) do{}while(0)
+#else
+#define LOG_TRACE(...) LOG(LL_TRACE, __VA_ARGS__)
+#endif
+
+/*==========================================================================
+ * METRICS (PER-THREAD COUNTERS AND PHASE HISTOGRAMS)
+ *==========================================================================*/
+
+enum Counter {
+    M_TCP_REQUESTS, M_TCP_ERRORS, M_UDP_REQUESTS, M_UDP_ERRORS,
+    M_TCP_REJECTED_CONN, M_TCP_REJECTED_QUEUE, M_UDP_REJECTED_QUEUE,
+    M_TCP_REJECTED_RATE, M_UDP_REJECTED_RATE,
+    M_CACHE_HITS, M_CACHE_MISSES,
+    M_UDP_RX_PKTS, M_UDP_RX_CALLS, M_UDP_TX_PKTS, M_UDP_TX_CALLS,
+    M_UDP_TRUNCATED,        // datagrams cut short by the receive buffer
+    M_UDP_NACKS,
+    M_UDP_EXPIRED,          // sessions dropped as idle
+    M_UDP_RECLAIMED,        // buffer bytes they held
+    M_COUNT
+};
+
+enum Transport { TR_TCP, TR_UDP, TR_COUNT };
+
+// Where a request's time goes: receiving it, decoding and validating the
+// graph, building the CSR, searching, and sending the reply (from the
+// moment it is first in line to go out).
+enum Phase { PH_RECV, PH_VALIDATE, PH_BUILD, PH_SEARCH, PH_SEND, PH_COUNT };
+
+// Every thread that records gets its own block, so recording is a plain
+// load and store on a line no other thread writes: no lock, no atomic
+// read-modify-write. Readers sum all blocks; a sum may miss updates in
+// flight but never sees a torn value. Blocks live as long as the server.
+class Metrics {
+public:
+    // Histogram bucket i < HIST_BUCKETS-1 counts durations below
+    // 2^(10+i) ns (1 us, 2 us, ... 69 s); the last bucket is the rest.
+    static const int HIST_BUCKETS = 28;
+
+    void add(Counter c, uint64_t v = 1){ bump(local().counters[c], v); }
+
+    void observe(Transport t, Phase p, chrono::steady_clock::duration d){
+        uint64_t ns = max<int64_t>(0, chrono::duration_cast<chrono::nanoseconds>(d).count());
+        int b = ns < 1024 ? 0 : min(63 - __builtin_clzll(ns) - 9, HIST_BUCKETS - 1);
+        Block& k = local();
+        bump(k.hist[t][p][b], 1);
+        bump(k.hist_ns[t][p], ns);
+    }
+
+    uint64_t total(Counter c){
+        lock_guard<mutex> lk(blocks_m);
+        uint64_t s = 0;
+        for(auto& k : blocks) s += k->counters[c].load(memory_order_relaxed);
+        return s;
+    }
+
+    // Summed histogram of one phase: per-bucket counts and total ns.
+    void histogram(Transport t, Phase p, uint64_t (&out)[HIST_BUCKETS], uint64_t& sum_ns){
+        lock_guard<mutex> lk(blocks_m);
+        fill(out, out + HIST_BUCKETS, 0);
+        sum_ns = 0;
+        for(auto& k : blocks){
+            for(int b=0;b<HIST_BUCKETS;b++) out[b] += k->hist[t][p][b].load(memory_order_relaxed);
+            sum_ns += k->hist_ns[t][p].load(memory_order_relaxed);
+        }
+    }
+
+private:
+    struct alignas(64) Block {
+        atomic<uint64_t> counters[M_COUNT] = {};
+        atomic<uint64_t> hist[TR_COUNT][PH_COUNT][HIST_BUCKETS] = {};
+        atomic<uint64_t> hist_ns[TR_COUNT][PH_COUNT] = {};
+    };
+    mutex blocks_m;                      // guards the list, not the counts
+    vector<unique_ptr<Block>> blocks;
+
+    static void bump(atomic<uint64_t>& a, uint64_t v){
+        a.store(a.load(memory_order_relaxed) + v, memory_order_relaxed);
+    }
+
+    Block& local(){
+        thread_local Block* mine = nullptr;
+        if(!mine){
+            lock_guard<mutex> lk(blocks_m);
+            blocks.push_back(make_unique<Block>());
+            mine = blocks.back().get();
+        }
+        return *mine;
+    }
+};
+
+Metrics metrics;
+
+// Records the time from construction to destruction under (t, p).
+struct PhaseTimer {
+    Transport t;
+    Phase p;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    ~PhaseTimer(){ metrics.observe(t, p, chrono::steady_clock::now() - t0); }
+};
+
+// Runs f() and records how long it took under (t, p).
+template<class F>
+auto timed(Transport t, Phase p, F&& f){
+    PhaseTimer pt{t, p};
+    return f();
+}
+
+// Prometheus text exposition of everything above plus live gauges;
+// served by OP_STATS and --metrics-port (see METRICS EXPOSITION).
+string metrics_text();
+
+/*==========================================================================
+ * GRAPH REGISTRY (UPLOAD ONCE, QUERY MANY)
+ *==========================================================================*/
+
+static inline uint64_t mix64(uint64_t x){
+    x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Seeds every hash of client data (graph handles, cache keys), so that
+// colliding inputs cannot be prepared offline.
+const uint64_t HASH_SEED = (uint64_t)random_device{}() << 32 | random_device{}();
+
+// 64-bit non-cryptographic hash, 8 bytes per step.
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed = 0){
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+    for(; len >= 8; p += 8, len -= 8){
+        uint64_t x;
+        memcpy(&x, p, 8);
+        h = (h ^ mix64(x)) * 0x9e3779b97f4a7c15ULL;
+    }
+    uint64_t t = 0;
+    memcpy(&t, p, len);
+    return mix64(h ^ mix64(t ^ len));
+}
+
+// Handle of a graph: hash of its decoded edge list, so every encoding of
+// the same graph maps to the same handle. 0 is never a valid handle.
+uint64_t graph_handle(int n, const vector<Edge>& edges){
+    uint64_t h = hash_bytes(edges.data(), edges.size() * sizeof(Edge), HASH_SEED ^ mix64(n));
+    return h ? h : 1;
+}
+
+// Where a graph goes when its handle is taken by a different one.
+static uint64_t next_handle(uint64_t h){
+    h = mix64(h + 1);
+    return h ? h : 1;
+}
+
+// A validated graph kept between requests. Queries hold a shared_ptr,
+// so a graph released mid-query stays alive until the query finishes.
+struct GraphEntry {
+    uint64_t handle = 0;
+    uint64_t serial = 0;         // never reused, unlike handles; keys cached paths
+    CsrGraph g;
+    size_t bytes = 0;
+    int refs = 0;                // uploads not yet released (registry lock)
+
+    once_flag lm_once;           // ALT landmarks, built by the first ALT query
+    Landmarks lm;
+
+    const Landmarks& landmarks(){
+        call_once(lm_once, [&]{ lm = build_landmarks(g); });
+        return lm;
+    }
+};
+
+size_t REGISTRY_BYTES = 1024u << 20;   // memory budget for registered graphs
+
+class GraphRegistry {
+public:
+    // Takes a reference to graph g, registering it if it is not there
+    // yet; the entry's handle is the one to give the client. Every graph
+    // found on the way is compared with g: one that only shares the hash
+    // sends g on to next_handle(h), so a collision never merges graphs.
+    // Fails on a full registry.
+    shared_ptr<GraphEntry> acquire(uint64_t h, CsrGraph&& g, string& err){
+        size_t sz = g.off.size() * sizeof(uint32_t) + g.arcs.size() * sizeof(Arc) +
+                    (size_t)ALT_LANDMARKS * g.n * sizeof(long long);
+
+        lock_guard<mutex> lk(mu);
+        for(auto it = graphs.find(h); it != graphs.end(); it = graphs.find(h = next_handle(h))){
+            auto& e = it->second;
+            if(same_graph(e->g, g)){
+                e->refs++;
+                return e;
+            }
+        }
+        if(used + sz > REGISTRY_BYTES){
+            err = "Graph registry full";
+            return nullptr;
+        }
+
+        auto e = make_shared<GraphEntry>();
+        e->handle = h;
+        e->serial = ++serials;
+        e->g = move(g);
+        e->bytes = sz;
+        e->refs = 1;
+        used += sz;
+        graphs[h] = e;
+        return e;
+    }
+
+    shared_ptr<GraphEntry> find(uint64_t h){
+        lock_guard<mutex> lk(mu);
+        auto it = graphs.find(h);
+        return it == graphs.end() ? nullptr : it->second;
+    }
+
+    // Drops one reference; the last one evicts the graph.
+    void release(uint64_t h){
+        lock_guard<mutex> lk(mu);
+        auto it = graphs.find(h);
+        if(it == graphs.end() || --it->second->refs > 0) return;
+        used -= it->second->bytes;
+        graphs.erase(it);
+    }
+
+private:
+    mutex mu;
+    unordered_map<uint64_t, shared_ptr<GraphEntry>> graphs;
+    size_t used = 0;
+    uint64_t serials = 0;
+
+    static bool same_graph(const CsrGraph& a, const CsrGraph& b){
+        return a.n == b.n && a.off == b.off && a.arcs.size() == b.arcs.size() &&
+               memcmp(a.arcs.data(), b.arcs.data(), a.arcs.size() * sizeof(Arc)) == 0;
+    }
+};
+
+GraphRegistry registry;
+
+/*==========================================================================
+ * RESULT CACHE (SHARDED LRU)
+ *==========================================================================*/
+
+// Identifies a query by what was sent, before decoding or validation:
+// a hash of the raw payload bytes plus the header fields. OP_QUERY
+// requests use the registry entry's serial instead: a handle can come
+// back with another graph once its entry is evicted, a serial cannot.
+// Search modes are not part of the key: they all return a shortest path.
+const int32_t KEY_HANDLE = -1;
+
+// The payload a key was hashed from, in up to two pieces (matrix and
+// weights). Not owned; the cache keeps a copy with each entry.
+struct KeyBytes {
+    const void* a = nullptr; size_t na = 0;
+    const void* b = nullptr; size_t nb = 0;
+
+    size_t size() const { return na + nb; }
+
+    bool same(const vector<char>& v) const {
+        return v.size() == na + nb && (!na || memcmp(v.data(), a, na) == 0) &&
+               (!nb || memcmp(v.data() + na, b, nb) == 0);
+    }
+
+    vector<char> copy() const {
+        vector<char> v(na + nb);
+        if(na) memcpy(v.data(), a, na);
+        if(nb) memcpy(v.data() + na, b, nb);
+        return v;
+    }
+};
+
+struct CacheKey {
+    uint64_t h = 0;
+    int32_t kind = 0;            // payload encoding, or KEY_HANDLE
+    int32_t n = 0, m = 0, S = 0, T = 0;
+    KeyBytes src;                // not part of the identity; checked on a hit
+
+    bool operator==(const CacheKey& o) const {
+        return h == o.h && kind == o.kind && n == o.n && m == o.m && S == o.S && T == o.T;
+    }
+};
+
+struct CacheKeyHash {
+    size_t operator()(const CacheKey& k) const {
+        return mix64(k.h ^ ((uint64_t)k.S << 32 | (uint32_t)k.T));
+    }
+};
+
+CacheKey matrix_key(int n, int m, int S, int T, const int* mat, const int* W){
+    size_t na = (size_t)n * m * sizeof(int), nb = (size_t)m * sizeof(int);
+    uint64_t h = hash_bytes(mat, na, HASH_SEED);
+    return {hash_bytes(W, nb, h), ENC_MATRIX, n, m, S, T, {mat, na, W, nb}};
+}
+
+CacheKey edges_key(int n, int m, int S, int T, const Edge* edges){
+    size_t na = (size_t)m * sizeof(Edge);
+    return {hash_bytes(edges, na, HASH_SEED), ENC_EDGES, n, m, S, T, {edges, na}};
+}
+
+size_t CACHE_BYTES = 64u << 20;   // 0 disables the cache
+
+// Bounded LRU of path results shared by all workers. Keys are spread
+// over independently locked shards so lookups rarely contend; each
+// shard evicts its least recently used entries past its share of
+// CACHE_BYTES. Hits hand out a shared_ptr, so nothing is copied under
+// the lock and eviction never frees a result still being sent. Entries
+// keep the payload they answer, so a hash collision is a miss, never
+// another graph's path; payloads too large for a shard are not cached.
+class ResultCache {
+public:
+    shared_ptr<const PathResult> get(const CacheKey& k){
+        if(!CACHE_BYTES) return nullptr;
+        Shard& s = shard(k);
+        lock_guard<mutex> lk(s.mu);
+        auto it = s.index.find(k);
+        if(it == s.index.end() || !k.src.same(it->second->second->bytes)){
+            metrics.add(M_CACHE_MISSES);
+            return nullptr;
+        }
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        metrics.add(M_CACHE_HITS);
+        auto& v = it->second->second;
+        return shared_ptr<const PathResult>(v, &v->R);
+    }
+
+    void put(const CacheKey& k, const PathResult& R){
+        size_t sz = entry_bytes(R, k.src.size());
+        size_t cap = CACHE_BYTES / SHARDS;
+        if(sz > cap) return;
+
+        auto v = make_shared<const Cached>(Cached{R, k.src.copy()});
+        CacheKey stored = k;
+        stored.src = {};
+        Shard& s = shard(k);
+        lock_guard<mutex> lk(s.mu);
+        if(s.index.count(k)) return;   // another worker got there first
+        s.lru.emplace_front(stored, move(v));
+        s.index[k] = s.lru.begin();
+        s.bytes += sz;
+        while(s.bytes > cap){
+            auto& [ok, ov] = s.lru.back();
+            s.bytes -= entry_bytes(ov->R, ov->bytes.size());
+            s.index.erase(ok);
+            s.lru.pop_back();
+        }
+    }
+
+private:
+    static const int SHARDS = 16;
+    struct Cached { PathResult R; vector<char> bytes; };
+    using Entry = pair<CacheKey, shared_ptr<const Cached>>;
+    struct Shard {
+        mutex mu;
+        list<Entry> lru;         // most recently used first
+        unordered_map<CacheKey, list<Entry>::iterator, CacheKeyHash> index;
+        size_t bytes = 0;
+    };
+    Shard shards[SHARDS];
+
+    // Approximate footprint, list and hash nodes included.
+    static size_t entry_bytes(const PathResult& R, size_t payload){
+        return sizeof(Entry) + sizeof(Cached) + 64 + R.path.size() * sizeof(int) + payload;
+    }
+
+    Shard& shard(const CacheKey& k){ return shards[mix64(k.h + k.S * 31 + k.T) % SHARDS]; }
+};
+
+ResultCache results;
+
+/*==========================================================================
+ * WORKER POOL (BOUNDED MPMC QUEUE)
+ *==========================================================================*/
+
+// Fixed-capacity ring of jobs shared by all producers and all workers.
+class JobQueue {
+public:
+    explicit JobQueue(size_t cap) : ring(cap) {}
+
+    // Never blocks: a full queue is reported to the caller.
+    bool try_push(function<void()> job){
+        {
+            lock_guard<mutex> lk(mu);
+            if(count == ring.size()) return false;
+            ring[(head + count) % ring.size()] = move(job);
+            count++;
+        }
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Blocks until a job is available.
+    function<void()> pop(){
+        unique_lock<mutex> lk(mu);
+        not_empty.wait(lk, [&]{ return count > 0; });
+        function<void()> job = move(ring[head]);
+        head = (head + 1) % ring.size();
+        count--;
+        return job;
+    }
+
+    size_t size(){
+        lock_guard<mutex> lk(mu);
+        return count;
+    }
+
+private:
+    mutex mu;
+    condition_variable not_empty;
+    vector<function<void()>> ring;
+    size_t head = 0, count = 0;
+};
+
+class WorkerPool {
+public:
+    WorkerPool(size_t threads, size_t queue_cap) : q(queue_cap) {
+        for(size_t i=0;i<threads;i++)
+            thread([this](){
+                while(true){
+                    auto job = q.pop();
+                    auto t0 = chrono::steady_clock::now();
+                    job();
+                    ran(chrono::steady_clock::now() - t0);
+                }
+            }).detach();
+    }
+
+    bool submit(function<void()> job){ return q.try_push(move(job)); }
+    size_t queued(){ return q.size(); }
+
+    // Moving average of the time one job runs.
+    double job_ns() const { return avg_ns.load(memory_order_relaxed); }
+
+private:
+    JobQueue q;
+    atomic<double> avg_ns{0};
+
+    // Racing updates may lose a sample; the average does not need them all.
+    void ran(chrono::steady_clock::duration d){
+        double ns = chrono::duration_cast<chrono::nanoseconds>(d).count();
+        double a = avg_ns.load(memory_order_relaxed);
+        avg_ns.store(a + (ns - a) / 8, memory_order_relaxed);
+    }
+};
+
+size_t   WORKERS     = max(1u, thread::hardware_concurrency());
+size_t   QUEUE_CAP   = 1024;
+unique_ptr<WorkerPool> pool;
+
+/*==========================================================================
+ * ADMISSION CONTROL (TOKEN BUCKETS, QUEUE DELAY)
+ *==========================================================================*/
+
+// Requests are admitted when their header arrives, before any payload
+// is accepted, so a refused client has not uploaded its graph for
+// nothing. A refusal names how long to wait before retrying.
+double RATE_LIMIT = 0;           // requests/s per source IP, 0 = unlimited
+double RATE_BURST = 0;           // bucket size, 0 = one second's worth
+int    MAX_EST_WAIT_MS = 2000;   // estimated queueing delay before refusing, 0 = no limit
+const int BUSY_RETRY_MIN_MS = 50;
+const int BUSY_RETRY_MAX_MS = 10000;
+
+static int busy_retry_ms(double wait_ms){
+    return (int)min<double>(BUSY_RETRY_MAX_MS, max<double>(BUSY_RETRY_MIN_MS, wait_ms));
+}
+
+// How long the queued jobs would take the workers to drain.
+static double queue_wait_ms(size_t queued){
+    return queued * pool->job_ns() / WORKERS / 1e6;
+}
+
+// 0 if a new job may queue now; otherwise the suggested retry delay,
+// which is how long until the queue is back under the limit.
+int queue_check(){
+    size_t q = pool->queued();
+    double wait = queue_wait_ms(q);
+    if(q < QUEUE_CAP && (!MAX_EST_WAIT_MS || wait <= MAX_EST_WAIT_MS)) return 0;
+    return busy_retry_ms(wait - MAX_EST_WAIT_MS);
+}
+
+// One token bucket per source IPv4 address, refilled at RATE_LIMIT per
+// second up to the burst size. Buckets sit in independently locked
+// shards; full ones carry no state and are pruned as a shard grows.
+class RateLimiter {
+public:
+    // 0 if ip may start a request now (its token is taken), otherwise
+    // the milliseconds until it may.
+    int take(uint32_t ip){
+        if(RATE_LIMIT <= 0) return 0;
+        double burst = RATE_BURST > 0 ? RATE_BURST : max(1.0, RATE_LIMIT);
+        auto now = chrono::steady_clock::now();
+
+        Shard& s = shards[mix64(ip) % SHARDS];
+        lock_guard<mutex> lk(s.mu);
+        if(s.map.size() >= s.prune_at) prune(s, now, burst);
+
+        auto [it, fresh] = s.map.try_emplace(ip, Bucket{burst, now});
+        Bucket& b = it->second;
+        double dt = chrono::duration<double>(now - b.last).count();
+        b.tokens = min(burst, b.tokens + dt * RATE_LIMIT);
+        b.last = now;
+        if(b.tokens >= 1){
+            b.tokens -= 1;
+            return 0;
+        }
+        return max(1, (int)ceil((1 - b.tokens) / RATE_LIMIT * 1000));
+    }
+
+private:
+    static const int SHARDS = 16;
+    static constexpr size_t PRUNE_MIN = 4096;
+    struct Bucket { double tokens; chrono::steady_clock::time_point last; };
+    struct alignas(64) Shard {
+        mutex mu;
+        unordered_map<uint32_t, Bucket> map;
+        size_t prune_at = PRUNE_MIN;
+    };
+    Shard shards[SHARDS];
+
+    // Drops buckets that have refilled completely. If most are still
+    // active, waits for the shard to double before scanning again.
+    static void prune(Shard& s, chrono::steady_clock::time_point now, double burst){
+        for(auto it = s.map.begin(); it != s.map.end(); ){
+            double dt = chrono::duration<double>(now - it->second.last).count();
+            if(it->second.tokens + dt * RATE_LIMIT >= burst) it = s.map.erase(it);
+            else ++it;
+        }
+        s.prune_at = max(PRUNE_MIN, s.map.size() * 2);
+    }
+};
+
+RateLimiter rate_limiter;
+
+enum Admit { ADMIT_OK, ADMIT_QUEUE, ADMIT_RATE };
+
+// Decides on a request from ip whose header just arrived. A refusal
+// sets retry_ms. The queue is checked first so that a request refused
+// for load does not spend the client's token.
+Admit admit_request(uint32_t ip, int& retry_ms){
+    if((retry_ms = queue_check())) return ADMIT_QUEUE;
+    if((retry_ms = rate_limiter.take(ip))) return ADMIT_RATE;
+    return ADMIT_OK;
+}
+
+const char* admit_reason(Admit a){
+    return a == ADMIT_RATE ? "rate limit reached" : "solver queue full";
+}
+
+/*==========================================================================
+ * BATCH QUERIES (ONE SSSP PER DISTINCT SOURCE)
+ *==========================================================================*/
+
+// Distance table for every (source, target) pair, optionally with paths.
+// Distinct sources are claimed one at a time by the calling worker and
+// by helper jobs queued on the pool. The caller only ever waits for
+// sources a helper has already started, so a batch finishes even when
+// every other worker is busy or the queue is full; helpers that start
+// after the last claim return at once. Paths are counted as they are
+// built; once they pass the byte budget the remaining sources are only
+// claimed, not searched.
+struct Batch {
+    const CsrGraph* g = nullptr;
+    vector<int> src, dst;          // src: distinct sources
+    vector<size_t> uses;           // times each distinct source was asked for
+    bool want_paths = false;
+
+    vector<vector<long long>> dist;         // [source][target], -1 = no path
+    vector<vector<vector<int>>> paths;      // [source][target] when wanted
+
+    size_t path_budget = 0;                 // reply bytes the paths may take
+    atomic<size_t> path_bytes{0};
+    atomic<bool> too_large{false};
+
+    atomic<size_t> next{0};
+    size_t finished = 0;
+    mutex mu;
+    condition_variable cv;
+
+    void drain(){
+        vector<long long> d;
+        vector<int> parent;
+        size_t mine = 0, i;
+        while((i = next++) < src.size()){
+            mine++;
+            if(too_large) continue;
+            sssp(*g, src[i], d, parent);
+            dist[i].resize(dst.size());
+            if(want_paths) paths[i].resize(dst.size());
+            for(size_t j=0;j<dst.size() && !too_large;j++){
+                dist[i][j] = d[dst[j]] == INF ? -1 : d[dst[j]];
+                if(!want_paths || d[dst[j]] == INF) continue;
+                paths[i][j] = path_to(d, parent, dst[j]).path;
+                size_t add = (1 + paths[i][j].size()) * sizeof(int64_t) * uses[i];
+                if((path_bytes += add) > path_budget) too_large = true;
+            }
+        }
+        if(mine){
+            lock_guard<mutex> lk(mu);
+            finished += mine;
+            cv.notify_all();
+        }
+    }
+};
+
+// Runs on a worker. Returns the table in request order: row i is
+// sources[i], even when a source is repeated. Fails, having stopped
+// early, when the paths would take more than path_budget reply bytes.
+bool run_batch(const CsrGraph& g, const vector<int>& sources, const vector<int>& targets,
+               bool want_paths, size_t path_budget,
+               vector<long long>& dist, vector<vector<int>>& paths){
+    auto b = make_shared<Batch>();
+    b->g = &g;
+    b->src = sources;
+    sort(b->src.begin(), b->src.end());
+    b->src.erase(unique(b->src.begin(), b->src.end()), b->src.end());
+    b->dst = targets;
+    b->want_paths = want_paths;
+    b->path_budget = path_budget;
+    b->uses.assign(b->src.size(), 0);
+    for(int s : sources)
+        b->uses[lower_bound(b->src.begin(), b->src.end(), s) - b->src.begin()]++;
+    b->dist.resize(b->src.size());
+    if(want_paths) b->paths.resize(b->src.size());
+
+    size_t helpers = b->src.empty() ? 0 : min(WORKERS, b->src.size()) - 1;
+    for(size_t k=0;k<helpers;k++)
+        if(!pool->submit([b]{ b->drain(); })) break;   // full: do the rest here
+    b->drain();
+    {
+        unique_lock<mutex> lk(b->mu);
+        b->cv.wait(lk, [&]{ return b->finished == b->src.size(); });
+    }
+
+    dist.clear();
+    paths.clear();
+    if(b->too_large) return false;
+    for(int s : sources){
+        size_t i = lower_bound(b->src.begin(), b->src.end(), s) - b->src.begin();
+        dist.insert(dist.end(), b->dist[i].begin(), b->dist[i].end());
+        if(want_paths)
+            for(auto& p : b->paths[i]) paths.push_back(p);
+    }
+    return true;
 }
 
 /*==========================================================================
- * DIJKSTRA + GRAPH BUILD
+ * TCP REQUEST HANDLING
  *==========================================================================*/
 
-long long INF = (1LL << 60);
+size_t MAX_PAYLOAD = 256u << 20;   // v2 matrix + weights bytes
+
+// Request header normalised from either protocol version.
+struct TcpRequest {
+    int32_t  version = PROTO_V1;
+    int32_t  encoding = ENC_MATRIX;
+    int32_t  op = OP_SOLVE;      // v2 only
+    SearchMode search = SEARCH_KIND;
+    bool keepalive = false;      // v2 FLAG_KEEPALIVE
+    bool want_paths = false;     // OP_BATCH FLAG_PATHS
+    uint64_t sources = 0, targets = 0;   // OP_BATCH list sizes
+    uint64_t request_id = 0;
+    int n = 0, m = 0, S = 0, T = 0;
+};
+
+// Request body as received, in its wire encoding.
+struct TcpPayload {
+    vector<int> mat, W;          // ENC_MATRIX
+    vector<Edge> edges;          // ENC_EDGES (read in place)
+    uint64_t var_len = 0;        // ENC_VARINT
+    vector<uint8_t> var;
+    uint64_t handle = 0;         // OP_QUERY, OP_RELEASE
+    vector<int64_t> ids;         // OP_BATCH sources, then targets
+};
+
+// Outcome of a request, encoded per protocol version when sent.
+struct Reply {
+    int32_t error_code = 1;
+    string message;
+    long long dist = -1;
+    vector<int> path;
+    uint64_t handle = 0;         // OP_UPLOAD: registered graph, one reference taken
+    vector<char> extra;          // op-specific bytes after the path (v2)
+};
+
+Reply error_reply(const string& msg){
+    Reply r;
+    r.message = msg;
+    return r;
+}
+
+Reply busy_reply(const string& why, int retry_ms){
+    Reply r;
+    r.error_code = ERR_BUSY;
+    r.message = "Server busy: " + why + ", retry after " + to_string(retry_ms) + " ms";
+    r.dist = retry_ms;
+    return r;
+}
+
+// Checks a v1 header before any payload is accepted.
+bool tcp_check_v1(const GraphRequest& req, TcpRequest& q, Reply& err){
+    if(!valid_nm(req.vertices, req.edges)){
+        err = error_reply("n/m invalid.");
+        return false;
+    }
+
+    int n = req.vertices;
+    if(req.start_node < 0 || req.start_node >= n ||
+       req.end_node   < 0 || req.end_node   >= n){
+        err = error_reply("Start/end invalid.");
+        return false;
+    }
+
+    q.n = req.vertices; q.m = req.edges;
+    q.S = req.start_node; q.T = req.end_node;
+    return true;
+}
+
+// v2 drops the [6,19] window; the payload size is bounded instead.
+bool tcp_check_v2(const GraphRequestV2& req, TcpRequest& q, Reply& err){
+    q.request_id = req.request_id;
+    if(q.op == OP_STATS) return true;
+
+    if(q.op == OP_QUERY || q.op == OP_RELEASE){
+        // S/T are checked against the registered graph by the worker
+        if(req.start_node > INT32_MAX || req.end_node > INT32_MAX){
+            err = error_reply("Start/end invalid.");
+            return false;
+        }
+        q.S = req.start_node; q.T = req.end_node;
+        return true;
+    }
+
+    // n is bounded on its own: the worker allocates per vertex whatever
+    // the payload size, and an empty matrix costs nothing to send.
+    if(req.vertices < 1 || req.vertices > INT32_MAX || req.edges > INT32_MAX ||
+       (req.edges == 0 && req.vertices > 1)){
+        err = error_reply("n/m invalid.");
+        return false;
+    }
+    if(req.vertices > MAX_PAYLOAD / sizeof(int32_t)){
+        err = error_reply("Graph too large.");
+        return false;
+    }
+    uint64_t bytes = 0;
+    if(q.encoding == ENC_MATRIX) bytes = (req.vertices * req.edges + req.edges) * sizeof(int32_t);
+    if(q.encoding == ENC_EDGES)  bytes = req.edges * sizeof(Edge);
+    if(q.encoding == ENC_VARINT) bytes = req.edges * 3;   // smallest encoding
+    if(bytes > MAX_PAYLOAD){
+        err = error_reply("Graph too large.");
+        return false;
+    }
+    if(q.op == OP_UPLOAD || q.op == OP_BATCH){
+        if(q.op == OP_BATCH){
+            // lists and the distance table must both fit
+            uint64_t ns = req.start_node, nt = req.end_node;
+            if(ns > MAX_PAYLOAD / sizeof(int64_t) || nt > MAX_PAYLOAD / sizeof(int64_t) ||
+               bytes + (ns + nt) * sizeof(int64_t) > MAX_PAYLOAD ||
+               (nt && ns > MAX_PAYLOAD / sizeof(int64_t) / nt)){
+                err = error_reply("Batch too large.");
+                return false;
+            }
+            q.sources = ns; q.targets = nt;
+        }
+        q.n = req.vertices; q.m = req.edges;
+        return true;
+    }
+    if(req.start_node >= req.vertices || req.end_node >= req.vertices){
+        err = error_reply("Start/end invalid.");
+        return false;
+    }
+
+    q.n = req.vertices; q.m = req.edges;
+    q.S = req.start_node; q.T = req.end_node;
+    return true;
+}
+
+// Decodes a graph payload to a validated edge list: the payload's own
+// list for ENC_EDGES, otherwise decoded into scratch. nullptr on error.
+const vector<Edge>* tcp_decode(const TcpRequest& q, const TcpPayload& body,
+                               vector<Edge>& scratch, Reply& err){
+    if(q.encoding == ENC_MATRIX){
+        if(!incidence_to_edges(q.n, q.m, body.mat.data(), body.W.data(), scratch)){
+            err = error_reply("Invalid incidence matrix");
+            return nullptr;
+        }
+        return &scratch;
+    }
+
+    const vector<Edge>* edges = &body.edges;
+    if(q.encoding == ENC_VARINT){
+        if(!decode_varint_edges(body.var, q.m, scratch)){
+            err = error_reply("Invalid edge encoding");
+            return nullptr;
+        }
+        edges = &scratch;
+    }
+    if(!valid_edges(q.n, *edges)){
+        err = error_reply("Invalid edge list");
+        return nullptr;
+    }
+    return edges;
+}
+
+Reply path_reply(const PathResult& R){
+    if(!R.ok) return error_reply("No path found");
+
+    Reply r;
+    r.error_code = 0;
+    r.message = "OK";
+    r.dist = R.dist;
+    r.path = R.path;
+    return r;
+}
+
+CacheKey payload_key(const TcpRequest& q, const TcpPayload& body){
+    if(q.encoding == ENC_MATRIX) return matrix_key(q.n, q.m, q.S, q.T, body.mat.data(), body.W.data());
+    if(q.encoding == ENC_EDGES)  return edges_key(q.n, q.m, q.S, q.T, body.edges.data());
+    return {hash_bytes(body.var.data(), body.var.size(), HASH_SEED), ENC_VARINT, q.n, q.m, q.S, q.T,
+            {body.var.data(), body.var.size()}};
+}
+
+Reply tcp_batch(const TcpRequest& q, const TcpPayload& body, const CsrGraph& g){
+    vector<int> src(q.sources), dst(q.targets);
+    for(size_t i=0;i<body.ids.size();i++){
+        int64_t v = body.ids[i];
+        if(v < 0 || v >= g.n) return error_reply("Start/end invalid.");
+        if(i < q.sources) src[i] = v;
+        else dst[i - q.sources] = v;
+    }
+
+    // the header check keeps the distance table itself within MAX_PAYLOAD
+    size_t bytes = src.size() * dst.size() * sizeof(int64_t);
+    vector<long long> dist;
+    vector<vector<int>> paths;
+    bool fits = timed(TR_TCP, PH_SEARCH, [&]{
+        return run_batch(g, src, dst, q.want_paths, MAX_PAYLOAD - bytes, dist, paths);
+    });
+    if(!fits) return error_reply("Batch result too large");
+    for(auto& p : paths) bytes += (1 + p.size()) * sizeof(int64_t);
+
+    Reply r;
+    r.error_code = 0;
+    r.message = "OK";
+    r.dist = 0;
+    r.extra.resize(bytes);
+    int64_t* p = (int64_t*)r.extra.data();
+    for(long long d : dist) *p++ = d;
+    for(auto& path : paths){
+        *p++ = path.size();
+        for(int v : path) *p++ = v;
+    }
+    return r;
+}
+
+// Runs on a complete request, on a worker thread. OP_RELEASE and
+// OP_STATS never get here: the event loop answers them itself.
+Reply tcp_solve(const TcpRequest& q, const TcpPayload& body){
+    if(q.op == OP_QUERY){
+        auto e = registry.find(body.handle);
+        if(!e) return error_reply("Unknown graph handle");
+        if(q.S >= e->g.n || q.T >= e->g.n) return error_reply("Start/end invalid.");
+
+        CacheKey key{e->serial, KEY_HANDLE, 0, 0, q.S, q.T, {}};
+        if(auto hit = results.get(key)) return path_reply(*hit);
+
+        const Landmarks* lm = q.search == SEARCH_MODE_ALT ? &e->landmarks() : nullptr;
+        auto R = timed(TR_TCP, PH_SEARCH, [&]{ return shortest_path(e->g,q.S,q.T,q.search,lm); });
+        results.put(key, R);
+        return path_reply(R);
+    }
+
+    CacheKey key;
+    if(q.op == OP_SOLVE){
+        key = payload_key(q, body);
+        if(auto hit = results.get(key)) return path_reply(*hit);
+    }
+
+    vector<Edge> scratch;
+    Reply err;
+    const vector<Edge>* edges = timed(TR_TCP, PH_VALIDATE, [&]{ return tcp_decode(q, body, scratch, err); });
+    if(!edges) return err;
+    auto build = [&]{ return timed(TR_TCP, PH_BUILD, [&]{ return build_csr(q.n, *edges); }); };
+
+    if(q.op == OP_UPLOAD){
+        string msg;
+        auto e = registry.acquire(graph_handle(q.n, *edges), build(), msg);
+        if(!e) return error_reply(msg);
+        uint64_t h = e->handle;
+
+        Reply r;
+        r.error_code = 0;
+        r.message = "OK";
+        r.dist = 0;
+        r.handle = h;
+        r.extra.resize(sizeof(h));
+        memcpy(r.extra.data(), &h, sizeof(h));
+        return r;
+    }
+    if(q.op == OP_BATCH) return tcp_batch(q, body, build());
+
+    auto g = build();
+    auto R = timed(TR_TCP, PH_SEARCH, [&]{ return shortest_path(g,q.S,q.T,q.search); });
+    results.put(key, R);
+    return path_reply(R);
+}
+
+Reply stats_reply(){
+    Reply r;
+    r.error_code = 0;
+    r.message = metrics_text();
+    r.dist = 0;
+    return r;
+}
+
+vector<char> encode_reply(const TcpRequest& q, const Reply& r){
+    vector<char> out;
+
+    if(q.version == PROTO_V1){
+        GraphResponse resp{};
+        resp.error_code  = r.error_code;
+        resp.path_length = r.error_code != 1 ? (int32_t)r.dist : -1;
+        resp.path_size   = r.path.size();
+        snprintf(resp.message, sizeof(resp.message), "%s", r.message.c_str());
+        for(size_t i=0;i<r.path.size() && i<64;i++)
+            resp.path[i] = r.path[i];
+
+        out.resize(sizeof(resp));
+        memcpy(out.data(), &resp, sizeof(resp));
+        return out;
+    }
+
+    GraphResponseV2 h{};
+    h.request_id  = q.request_id;
+    h.error_code  = r.error_code;
+    h.message_len = r.message.size();
+    h.distance    = r.error_code != 1 ? r.dist : -1;
+    h.path_size   = r.path.size();
+    h.body_len    = h.message_len + h.path_size * sizeof(int64_t);
+    h.body_len   += r.extra.size();
+
+    out.resize(sizeof(h) + h.body_len);
+    char* p = out.data();
+    memcpy(p, &h, sizeof(h));                 p += sizeof(h);
+    memcpy(p, r.message.data(), h.message_len); p += h.message_len;
+    for(int v : r.path){
+        int64_t x = v;
+        memcpy(p, &x, sizeof(x));
+        p += sizeof(x);
+    }
+    if(!r.extra.empty()) memcpy(p, r.extra.data(), r.extra.size());
+    return out;
+}
+
+/*==========================================================================
+ * TCP EVENT LOOP (EPOLL, NON-BLOCKING)
+ *==========================================================================*/
+
+atomic<int> tcp_clients{0};
+const int TCP_MAX_CONN        = 4096;
+const int TCP_MAX_INFLIGHT    = 32;     // pipelined requests per connection
+const int TCP_IDLE_TIMEOUT_MS = 30000;  // no request in progress
+const int TCP_READ_TIMEOUT_MS = 10000;  // request/response stalled mid-way
+
+enum TcpState {
+    TCP_READ_REQ, TCP_READ_REQ2,                 // headers
+    TCP_READ_MAT, TCP_READ_W,                    // ENC_MATRIX
+    TCP_READ_EDGES,                              // ENC_EDGES
+    TCP_READ_VLEN, TCP_READ_VAR,                 // ENC_VARINT
+    TCP_READ_HANDLE,                             // OP_QUERY, OP_RELEASE
+    TCP_READ_IDS,                                // OP_BATCH, after the graph
+    TCP_SKIP,                                    // payload of a refused request
+    TCP_REQ_DONE,                                // complete, not yet dispatched
+    TCP_NO_READ                                  // close once responses are out
+};
+
+struct TcpConn {
+    int fd = -1;
+    uint64_t id = 0;           // distinguishes reuse of the same fd
+    uint32_t ip = 0;           // peer IPv4 address, for rate limiting
+    TcpState st = TCP_READ_REQ;
+    size_t done = 0;           // bytes of the current part read
+    uint64_t skip = 0;         // TCP_SKIP: payload bytes left to discard
+    bool refused = false;      // answered busy; the payload is discarded
+
+    GraphRequest req{};
+    GraphRequestV2 req2{};
+    TcpRequest q;
+    TcpPayload body;
+
+    int inflight = 0;              // requests handed to workers
+    deque<vector<char>> outq;      // encoded responses, in completion order
+    size_t out_done = 0;           // bytes of outq.front() already sent
+    chrono::steady_clock::time_point out_since;   // outq.front() reached the front
+    uint32_t events = 0;           // current epoll mask
+    unordered_map<uint64_t, int> handles;   // registry references held
+
+    // io_uring backend
+    vector<char> stash;            // received bytes of a request not yet started
+    int io_pending = 0;            // operations submitted, not completed
+    bool recv_armed = false, send_armed = false;
+
+    chrono::steady_clock::time_point last;   // last progress
+    chrono::steady_clock::time_point req_start;   // header of the current request read
+};
+
+static void set_nonblock(int fd){
+    int fl = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+// Receives skipped payload bytes. Its contents are never read, so the
+// connections may share it.
+static char tcp_skip_buf[16384];
+
+// Buffer and size of the part the connection is currently reading.
+static pair<char*, size_t> tcp_part(TcpConn& c){
+    switch(c.st){
+        case TCP_SKIP:       return {tcp_skip_buf, (size_t)min<uint64_t>(c.skip, sizeof(tcp_skip_buf))};
+        case TCP_READ_REQ:   return {(char*)&c.req,  sizeof(c.req)};
+        case TCP_READ_REQ2:  return {(char*)&c.req2, sizeof(c.req2)};
+        case TCP_READ_MAT:   return {(char*)c.body.mat.data(), c.body.mat.size()*sizeof(int)};
+        case TCP_READ_W:     return {(char*)c.body.W.data(),   c.body.W.size()*sizeof(int)};
+        case TCP_READ_EDGES: return {(char*)c.body.edges.data(), c.body.edges.size()*sizeof(Edge)};
+        case TCP_READ_VLEN:  return {(char*)&c.body.var_len, sizeof(c.body.var_len)};
+        case TCP_READ_VAR:   return {(char*)c.body.var.data(), c.body.var.size()};
+        case TCP_READ_HANDLE:return {(char*)&c.body.handle, sizeof(c.body.handle)};
+        case TCP_READ_IDS:   return {(char*)c.body.ids.data(), c.body.ids.size()*sizeof(int64_t)};
+        default:             return {nullptr, 0};
+    }
+}
+
+// Queues an encoded response behind those already waiting to go out.
+static void tcp_queue(TcpConn& c, vector<char> out){
+    if(c.outq.empty()) c.out_since = chrono::steady_clock::now();
+    c.outq.push_back(move(out));
+}
+
+// The front response has been written in full.
+static void tcp_sent(TcpConn& c){
+    auto now = chrono::steady_clock::now();
+    metrics.observe(TR_TCP, PH_SEND, now - c.out_since);
+    c.outq.pop_front();
+    c.out_done = 0;
+    c.out_since = now;
+}
+
+// Rejects the request being read. Its payload is left unread, so the
+// stream cannot be resynchronised: the connection closes after replying.
+static void tcp_reject(TcpConn& c, const Reply& err){
+    tcp_queue(c, encode_reply(c.q, err));
+    c.st = TCP_NO_READ;
+}
+
+// Answers busy without reading the payload into memory. The payload is
+// still received and discarded, which keeps a keep-alive connection in
+// step and lets the client read the reply: closing on unread data would
+// reset the connection and could drop it. A varint payload's length is
+// known only once its prefix has been read.
+static void tcp_refuse(TcpConn& c, const Reply& busy){
+    tcp_queue(c, encode_reply(c.q, busy));
+    c.refused = true;
+    c.skip = 0;
+    if(c.q.op == OP_BATCH) c.skip += (c.q.sources + c.q.targets) * sizeof(int64_t);
+
+    if(c.q.op == OP_QUERY)              c.skip += sizeof(c.body.handle);
+    else if(c.q.encoding == ENC_MATRIX) c.skip += ((uint64_t)c.q.n * c.q.m + c.q.m) * sizeof(int);
+    else if(c.q.encoding == ENC_EDGES)  c.skip += (uint64_t)c.q.m * sizeof(Edge);
+    else { c.st = TCP_READ_VLEN; return; }
+    c.st = TCP_SKIP;
+}
+
+// Advances the state machine after a part has been fully read.
+// Leaves the connection in TCP_REQ_DONE once the request is complete.
+static void tcp_part_done(TcpConn& c){
+    c.done = 0;
+    Reply err;
+    bool ok = true;
+
+    if(c.st == TCP_SKIP){
+        c.skip -= min<uint64_t>(c.skip, sizeof(tcp_skip_buf));
+        if(c.skip == 0){
+            c.refused = false;
+            c.st = c.q.keepalive ? TCP_READ_REQ : TCP_NO_READ;
+        }
+        return;
+    }
+
+    if(c.st == TCP_READ_REQ){
+        c.req_start = chrono::steady_clock::now();
+        c.q = TcpRequest{};
+        c.q.version  = proto_version(c.req.reserved);
+        c.q.encoding = proto_encoding(c.req.reserved);
+        c.q.keepalive = c.q.version == PROTO_V2 && (c.req.reserved & FLAG_KEEPALIVE);
+        c.q.op = proto_op(c.req.reserved);
+        c.q.want_paths = c.req.reserved & FLAG_PATHS;
+        if(proto_search(c.req.reserved) != SEARCH_DEFAULT)
+            c.q.search = (SearchMode)proto_search(c.req.reserved);
+        if(c.q.version != PROTO_V1 && c.q.version != PROTO_V2){
+            c.q.version = PROTO_V1;   // answer in the only format we know it reads
+            err = error_reply("Unsupported protocol version");
+            ok = false;
+        }
+        else if(c.q.encoding > ENC_VARINT){
+            err = error_reply("Unsupported payload encoding");
+            ok = false;
+        }
+        else if(proto_search(c.req.reserved) > SEARCH_ALT){
+            err = error_reply("Unsupported search mode");
+            ok = false;
+        }
+        else if(c.q.op > OP_STATS || (c.q.op != OP_SOLVE && c.q.version == PROTO_V1)){
+            err = error_reply("Unsupported operation");
+            ok = false;
+        }
+        else if(c.q.version == PROTO_V2){
+            c.st = TCP_READ_REQ2;
+            return;
+        }
+        else ok = tcp_check_v1(c.req, c.q, err);
+    }
+    else if(c.st == TCP_READ_REQ2){
+        ok = tcp_check_v2(c.req2, c.q, err);
+    }
+
+    if(!ok){
+        tcp_reject(c, err);
+        return;
+    }
+
+    // Admission, before the payload is read. RELEASE and STATS cost
+    // nothing and are always answered.
+    if((c.st == TCP_READ_REQ || c.st == TCP_READ_REQ2) &&
+       c.q.op != OP_RELEASE && c.q.op != OP_STATS){
+        int ms;
+        Admit a = admit_request(c.ip, ms);
+        if(a != ADMIT_OK){
+            metrics.add(a == ADMIT_RATE ? M_TCP_REJECTED_RATE : M_TCP_REJECTED_QUEUE);
+            LOG_DEBUG("[TCP] request refused (%s), retry after %d ms", admit_reason(a), ms);
+            c.body = TcpPayload{};
+            tcp_refuse(c, busy_reply(admit_reason(a), ms));
+            return;
+        }
+    }
+
+    if(c.st == TCP_READ_REQ || c.st == TCP_READ_REQ2){
+        c.body = TcpPayload{};
+        if(c.q.op == OP_STATS){
+            c.st = TCP_REQ_DONE;
+        }
+        else if(c.q.op == OP_QUERY || c.q.op == OP_RELEASE){
+            c.st = TCP_READ_HANDLE;
+        }
+        else if(c.q.encoding == ENC_MATRIX){
+            c.body.mat.assign((size_t)c.q.n * c.q.m, 0);
+            c.body.W.assign(c.q.m, 0);
+            c.st = TCP_READ_MAT;
+        }
+        else if(c.q.encoding == ENC_EDGES){
+            c.body.edges.resize(c.q.m);
+            c.st = TCP_READ_EDGES;
+        }
+        else c.st = TCP_READ_VLEN;
+    }
+    else if(c.st == TCP_READ_VLEN && c.refused){
+        if(c.body.var_len > MAX_PAYLOAD) c.st = TCP_NO_READ;   // already answered
+        else {
+            c.skip += c.body.var_len;
+            c.st = TCP_SKIP;
+        }
+    }
+    else if(c.st == TCP_READ_VLEN){
+        if(c.body.var_len > MAX_PAYLOAD){
+            tcp_reject(c, error_reply("Graph too large."));
+            return;
+        }
+        c.body.var.resize(c.body.var_len);
+        c.st = TCP_READ_VAR;
+    }
+    else if(c.st == TCP_READ_MAT){
+        c.st = TCP_READ_W;
+    }
+    else if(c.q.op == OP_BATCH && c.st != TCP_READ_IDS){   // graph read, lists next
+        c.body.ids.resize(c.q.sources + c.q.targets);
+        c.st = TCP_READ_IDS;
+    }
+    else c.st = TCP_REQ_DONE;   // last part of any encoding
+
+    if(c.st == TCP_REQ_DONE)
+        metrics.observe(TR_TCP, PH_RECV, chrono::steady_clock::now() - c.req_start);
+}
+
+// Connection bookkeeping shared by the TCP backends: admission, worker
+// dispatch and completions, graph handle references and timeouts. The
+// backend does the socket I/O and provides flush(c), update(c) and
+// drop(c), with the same meaning in both.
+template<class Backend>
+class TcpCore {
+protected:
+    int done_fd = eventfd(0, EFD_NONBLOCK);
+    uint64_t next_id = 1;
+    unordered_map<int, unique_ptr<TcpConn>> conns;
+
+    // Responses produced by workers, handed back to the loop thread.
+    struct Done { int fd; uint64_t id; vector<char> out; uint64_t handle; };
+    mutex done_m;
+    vector<Done> completed;
+
+    Backend& io(){ return static_cast<Backend&>(*this); }
+
+    // Registers an accepted socket, or closes it when at TCP_MAX_CONN.
+    // Nothing is sent: the reply format depends on the protocol version,
+    // which only the first request header would tell.
+    TcpConn* admit(int fd){
+        if(tcp_clients.load() >= TCP_MAX_CONN){
+            LOG_WARN("[TCP] connection limit reached, client refused");
+            metrics.add(M_TCP_REJECTED_CONN);
+            close(fd);
+            return nullptr;
+        }
+
+        auto conn = make_unique<TcpConn>();
+        conn->fd = fd;
+        sockaddr_in peer{};
+        socklen_t len = sizeof(peer);
+        if(getpeername(fd, (sockaddr*)&peer, &len) == 0) conn->ip = ntohl(peer.sin_addr.s_addr);
+        conn->id = next_id++;
+        conn->last = chrono::steady_clock::now();
+        TcpConn* c = conn.get();
+        conns[fd] = move(conn);
+        tcp_clients++;
+        return c;
+    }
+
+    // Releases the connection's graph references and unregisters it. The
+    // backend has closed the socket; it gets the connection back in case
+    // it must outlive pending I/O.
+    unique_ptr<TcpConn> forget(TcpConn* c){
+        for(auto& [h, k] : c->handles)
+            while(k--) registry.release(h);
+
+        auto it = conns.find(c->fd);
+        unique_ptr<TcpConn> own = move(it->second);
+        conns.erase(it);
+        tcp_clients--;
+        return own;
+    }
+
+    // Hands a complete request to the worker pool and gets ready for the
+    // next one on keep-alive connections.
+    void dispatch(TcpConn* c){
+        if(c->q.op == OP_RELEASE || c->q.op == OP_STATS){
+            Reply r = c->q.op == OP_STATS ? stats_reply() : release(c, c->body.handle);
+            tcp_queue(*c, encode_reply(c->q, r));
+            c->st = c->q.keepalive ? TCP_READ_REQ : TCP_NO_READ;
+            return;
+        }
+
+        auto q    = c->q;
+        auto body = make_shared<TcpPayload>(move(c->body));
+        int fd = c->fd;
+        uint64_t id = c->id;
+
+        c->inflight++;
+        bool ok = pool->submit([this, fd, id, q, body](){
+            Reply r;
+            try { r = tcp_solve(q, *body); }
+            catch(const bad_alloc&)    { r = error_reply("Out of memory"); }
+            catch(const length_error&) { r = error_reply("Graph too large."); }
+            metrics.add(M_TCP_REQUESTS);
+            if(r.error_code) metrics.add(M_TCP_ERRORS);
+            vector<char> out = encode_reply(q, r);
+            {
+                lock_guard<mutex> lk(done_m);
+                completed.push_back({fd, id, move(out), r.handle});
+            }
+            uint64_t one = 1;
+            (void)!write(done_fd, &one, sizeof(one));
+        });
+
+        if(!ok){
+            c->inflight--;
+            LOG_WARN("[TCP] solver queue full, request rejected");
+            metrics.add(M_TCP_REJECTED_QUEUE);
+            int ms = busy_retry_ms(queue_wait_ms(QUEUE_CAP));
+            tcp_queue(*c, encode_reply(q, busy_reply("solver queue full", ms)));
+        }
+        c->st = q.keepalive ? TCP_READ_REQ : TCP_NO_READ;
+    }
+
+    // Queues finished responses on their connections. The backend has
+    // consumed the done_fd wakeup.
+    void deliver_done(){
+        vector<Done> batch;
+        {
+            lock_guard<mutex> lk(done_m);
+            batch.swap(completed);
+        }
+        for(auto& d : batch){
+            auto it = conns.find(d.fd);
+            if(it == conns.end() || it->second->id != d.id){   // gone
+                if(d.handle) registry.release(d.handle);
+                continue;
+            }
+            TcpConn* c = it->second.get();
+            c->inflight--;
+            if(d.handle) c->handles[d.handle]++;
+            tcp_queue(*c, move(d.out));
+            if(io().flush(c)) io().update(c);
+        }
+    }
+
+    // Gives back one of the connection's references to a graph.
+    Reply release(TcpConn* c, uint64_t h){
+        auto it = c->handles.find(h);
+        if(it == c->handles.end()) return error_reply("Unknown graph handle");
+        if(--it->second == 0) c->handles.erase(it);
+        registry.release(h);
+
+        Reply r;
+        r.error_code = 0;
+        r.message = "OK";
+        r.dist = 0;
+        return r;
+    }
+
+    void sweep(chrono::steady_clock::time_point now){
+        vector<TcpConn*> expired;
+        for(auto& [fd, c] : conns){
+            bool mid_request = c->st < TCP_REQ_DONE && (c->st != TCP_READ_REQ || c->done > 0);
+            bool idle = c->st == TCP_READ_REQ && c->done == 0 &&
+                        c->inflight == 0 && c->outq.empty();
+
+            int limit;
+            if(!c->outq.empty() || mid_request) limit = TCP_READ_TIMEOUT_MS;
+            else if(idle)                       limit = TCP_IDLE_TIMEOUT_MS;
+            else continue;   // waiting on a worker, not the peer
+
+            auto ms = chrono::duration_cast<chrono::milliseconds>(now - c->last).count();
+            if(ms >= limit) expired.push_back(c.get());
+        }
+        for(auto* c : expired) io().drop(c);
+    }
+};
+
+// One epoll thread owns every connection. v1 and plain v2 connections
+// carry a single request. v2 requests flagged FLAG_KEEPALIVE keep the
+// connection open: the client may pipeline further requests without
+// waiting, and responses go out as workers finish them, tagged with the
+// request id. Reading pauses while TCP_MAX_INFLIGHT requests are queued.
+class TcpServer : public TcpCore<TcpServer> {
+public:
+    explicit TcpServer(int listen_fd) : lfd(listen_fd) {}
+
+    void run(){
+        ep = epoll_create1(0);
+        set_nonblock(lfd);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;           // nullptr marks the listening socket
+        epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &done_fd;          // worker completions
+        epoll_ctl(ep, EPOLL_CTL_ADD, done_fd, &ev);
+
+        vector<epoll_event> evs(256);
+        auto last_sweep = chrono::steady_clock::now();
+
+        while(true){
+            int k = epoll_wait(ep, evs.data(), evs.size(), 1000);
+            if(k < 0 && errno != EINTR) { LOG_ERROR("epoll_wait: %s", strerror(errno)); return; }
+
+            for(int i=0;i<k;i++){
+                void* tag = evs[i].data.ptr;
+                if(!tag)             { accept_all(); continue; }
+                if(tag == &done_fd)  { drain_done(); continue; }
+
+                TcpConn* c = (TcpConn*)tag;
+                if(c->fd < 0) continue;          // dropped earlier in this batch
+                uint32_t e = evs[i].events;
+                if(e & (EPOLLERR | EPOLLHUP)) { drop(c); continue; }
+                if((e & (EPOLLIN | EPOLLRDHUP)) && !on_readable(c)) continue;
+                if((e & EPOLLOUT) && !flush(c)) continue;
+                update(c);
+            }
+            dropped.clear();
+
+            auto now = chrono::steady_clock::now();
+            if(now - last_sweep >= chrono::seconds(1)){
+                sweep(now);
+                last_sweep = now;
+            }
+        }
+    }
+
+private:
+    friend class TcpCore<TcpServer>;
+    int lfd, ep = -1;
+    vector<unique_ptr<TcpConn>> dropped;   // freed once the event batch is done
+
+    // Re-arms epoll for what the connection is waiting on, or closes it
+    // once it will never read again and has nothing left to send.
+    // Returns false if the connection was closed.
+    bool update(TcpConn* c){
+        if(c->st == TCP_NO_READ && c->inflight == 0 && c->outq.empty()){
+            drop(c);
+            return false;
+        }
+
+        uint32_t ev = 0;
+        if(c->st < TCP_REQ_DONE && c->inflight < TCP_MAX_INFLIGHT) ev |= EPOLLIN | EPOLLRDHUP;
+        if(!c->outq.empty()) ev |= EPOLLOUT;
+        if(ev != c->events){
+            epoll_event e{};
+            e.events = ev;
+            e.data.ptr = c;
+            epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &e);
+            c->events = ev;
+        }
+        return true;
+    }
+
+    void drain_done(){
+        uint64_t cnt;
+        (void)!read(done_fd, &cnt, sizeof(cnt));
+        deliver_done();
+    }
+
+    void accept_all(){
+        while(true){
+            sockaddr_in a; socklen_t L = sizeof(a);
+            int fd = accept4(lfd, (sockaddr*)&a, &L, SOCK_NONBLOCK);
+            if(fd < 0) return;   // EAGAIN or transient error
+
+            TcpConn* c = admit(fd);
+            if(!c) continue;
+            c->events = EPOLLIN | EPOLLRDHUP;
+
+            epoll_event ev{};
+            ev.events = c->events;
+            ev.data.ptr = c;
+            if(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0){
+                forget(c);
+                close(fd);
+            }
+        }
+    }
+
+    // Reads as many requests as are available. Returns false if the
+    // connection was closed.
+    bool on_readable(TcpConn* c){
+        while(c->st < TCP_REQ_DONE && c->inflight < TCP_MAX_INFLIGHT){
+            auto [buf, len] = tcp_part(*c);
+            if(len > 0){
+                ssize_t r = recv(c->fd, buf + c->done, len - c->done, 0);
+                if(r == 0){
+                    // Peer finished sending; still answer what it already sent.
+                    c->st = TCP_NO_READ;
+                    break;
+                }
+                if(r < 0){
+                    if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+                    if(errno == EINTR) continue;
+                    drop(c);
+                    return false;
+                }
+                c->last = chrono::steady_clock::now();
+                c->done += r;
+                if(c->done < len) continue;
+            }
+
+            tcp_part_done(*c);
+            if(c->st == TCP_REQ_DONE) dispatch(c);
+        }
+
+        return flush(c) && update(c);
+    }
+
+    // Sends queued responses until the socket would block. Returns false
+    // if the connection was closed.
+    bool flush(TcpConn* c){
+        while(!c->outq.empty()){
+            auto& out = c->outq.front();
+            ssize_t r = send(c->fd, out.data() + c->out_done, out.size() - c->out_done,
+                             MSG_NOSIGNAL);
+            if(r < 0){
+                if(errno == EAGAIN || errno == EWOULDBLOCK) return true;
+                if(errno == EINTR) continue;
+                drop(c);
+                return false;
+            }
+            c->out_done += r;
+            c->last = chrono::steady_clock::now();
+            if(c->out_done == out.size()) tcp_sent(*c);
+        }
+        return true;
+    }
+
+    // Later events of the same batch may still name the connection, so
+    // it is only marked closed here and freed after the batch.
+    void drop(TcpConn* c){
+        int fd = c->fd;
+        epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        dropped.push_back(forget(c));
+        c->fd = -1;
+    }
+};
+
+/*==========================================================================
+ * TCP EVENT LOOP (IO_URING)
+ *==========================================================================*/
+
+// Minimal io_uring over the raw syscalls: the mapped submission and
+// completion queues, plus one ring of provided buffers that the kernel
+// picks from for recv. Entries queued with sqe() go to the kernel in
+// one io_uring_enter per enter() call.
+class Uring {
+public:
+    ~Uring(){
+        if(br) munmap(br, buf_count * sizeof(io_uring_buf));
+        if(sqes) munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+        if(ring) munmap(ring, ring_bytes);
+        if(fd >= 0) close(fd);
+    }
+
+    bool init(unsigned entries, unsigned cq_entries){
+        // Completion work runs only when this thread waits for it, if the
+        // kernel allows (6.1+ / 5.19+); the ring has a single user.
+        const unsigned modes[] = {
+            IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+            IORING_SETUP_COOP_TASKRUN,
+            0
+        };
+        io_uring_params p{};
+        for(unsigned mode : modes){
+            p = io_uring_params{};
+            p.flags = IORING_SETUP_CQSIZE | mode;
+            p.cq_entries = cq_entries;
+            fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+            if(fd >= 0 || errno != EINVAL) break;
+        }
+        if(fd < 0) return false;
+        if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP))
+            return false;
+
+        ring_bytes = max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                         p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+        void* r = mmap(nullptr, ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_SQ_RING);
+        if(r == MAP_FAILED) return false;
+        ring = (char*)r;
+        sq_entries = p.sq_entries;
+        void* q = mmap(nullptr, sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if(q == MAP_FAILED) return false;
+        sqes = (io_uring_sqe*)q;
+
+        sq_head  = (unsigned*)(ring + p.sq_off.head);
+        sq_tail  = (unsigned*)(ring + p.sq_off.tail);
+        sq_mask  = *(unsigned*)(ring + p.sq_off.ring_mask);
+        sq_array = (unsigned*)(ring + p.sq_off.array);
+        cq_head  = (unsigned*)(ring + p.cq_off.head);
+        cq_tail  = (unsigned*)(ring + p.cq_off.tail);
+        cq_mask  = *(unsigned*)(ring + p.cq_off.ring_mask);
+        cqes     = (io_uring_cqe*)(ring + p.cq_off.cqes);
+        tail = *sq_tail;
+        return true;
+    }
+
+    bool supports(initializer_list<int> ops){
+        vector<char> mem(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+        io_uring_probe* pr = (io_uring_probe*)mem.data();
+        if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, pr, 256) < 0) return false;
+        for(int op : ops)
+            if(op > pr->last_op || !(pr->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+        return true;
+    }
+
+    // Registers count buffers of size bytes as buffer group `group`.
+    // count must be a power of two.
+    bool provide(unsigned count, unsigned size, uint16_t group){
+        void* m = mmap(nullptr, count * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(m == MAP_FAILED) return false;
+        br = (io_uring_buf_ring*)m;
+        buf_count = count;
+        buf_size = size;
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = (uint64_t)br;
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+            return false;
+
+        bufs.resize((size_t)count * size);
+        for(unsigned b=0;b<count;b++) recycle(b);
+        return true;
+    }
+
+    char* buffer(unsigned bid){ return bufs.data() + (size_t)bid * buf_size; }
+
+    // Gives a consumed buffer back to the kernel.
+    void recycle(unsigned bid){
+        io_uring_buf* b = &br->bufs[br_tail & (buf_count - 1)];
+        b->addr = (uint64_t)buffer(bid);
+        b->len  = buf_size;
+        b->bid  = bid;
+        br_tail++;
+        __atomic_store_n(&br->tail, br_tail, __ATOMIC_RELEASE);
+    }
+
+    // Next free submission entry, zeroed. Submits what is queued first
+    // if the queue is full.
+    io_uring_sqe* sqe(){
+        while(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) enter(0);
+        unsigned i = tail & sq_mask;
+        sq_array[i] = i;
+        tail++;
+        memset(&sqes[i], 0, sizeof(io_uring_sqe));
+        return &sqes[i];
+    }
+
+    // Submits everything queued and waits for at least `wait` completions.
+    void enter(unsigned wait){
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        unsigned pending = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if(syscall(__NR_io_uring_enter, fd, pending, wait,
+                   wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0) < 0 &&
+           errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            LOG_ERROR("io_uring_enter: %s", strerror(errno));
+    }
+
+    // Calls f(cqe) for every completion available.
+    template<class F>
+    void reap(F f){
+        unsigned head = *cq_head;
+        unsigned end  = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != end; head++){
+            io_uring_cqe e = cqes[head & cq_mask];
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            f(e);
+        }
+    }
+
+private:
+    int fd = -1;
+    char* ring = nullptr;
+    size_t ring_bytes = 0;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned *sq_head, *sq_tail, *sq_array, *cq_head, *cq_tail;
+    unsigned sq_mask = 0, cq_mask = 0, sq_entries = 0;
+    unsigned tail = 0;              // local submission tail, published on enter
+
+    io_uring_buf_ring* br = nullptr;
+    unsigned buf_count = 0, buf_size = 0;
+    uint16_t br_tail = 0;
+    vector<char> bufs;
+};
+
+const unsigned URING_ENTRIES  = 1024;
+const unsigned URING_CQ       = 16384;
+const unsigned URING_BUFS     = 512;      // provided recv buffers
+const unsigned URING_BUF_SIZE = 16384;
+const uint16_t URING_BGID     = 0;
+
+// The same connections and request handling as TcpServer, with the I/O
+// done as io_uring operations: a multishot accept, one recv and at most
+// one send in flight per connection, a read of the worker eventfd and a
+// one-second timeout for the idle sweep. Everything queued while
+// handling a batch of completions is submitted by the next single
+// io_uring_enter, which also waits for the following batch.
+//
+// Small reads land in provided buffers and are fed through the request
+// state machine, so a header and a small payload arrive in one recv;
+// parts of at least URING_BUF_SIZE bytes are received in place. A closed
+// connection is kept until its pending operations complete, since they
+// still point into it.
+class UringTcpServer : public TcpCore<UringTcpServer> {
+public:
+    explicit UringTcpServer(int listen_fd) : lfd(listen_fd) {}
+
+    // True if the kernel has every operation this backend uses.
+    static bool available(){
+        Uring r;
+        return r.init(8, 16) &&
+               r.supports({IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+                           IORING_OP_READ, IORING_OP_TIMEOUT}) &&
+               r.provide(1, 64, URING_BGID);
+    }
+
+    void run(){
+        if(!ring.init(URING_ENTRIES, URING_CQ) ||
+           !ring.provide(URING_BUFS, URING_BUF_SIZE, URING_BGID)){
+            LOG_ERROR("io_uring setup failed");
+            return;
+        }
+        // the ring waits on these itself
+        fcntl(done_fd, F_SETFL, fcntl(done_fd, F_GETFL, 0) & ~O_NONBLOCK);
+        fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL, 0) & ~O_NONBLOCK);
+
+        arm_accept();
+        arm_done();
+        arm_tick();
+        while(true){
+            ring.enter(1);
+            ring.reap([this](const io_uring_cqe& e){ complete(e); });
+        }
+    }
+
+private:
+    friend class TcpCore<UringTcpServer>;
+
+    // user_data: a TcpConn pointer tagged with the operation, or a bare tag
+    enum : uint64_t { U_RECV = 1, U_SEND = 2, U_ACCEPT = 3, U_DONE = 4, U_TICK = 5, U_MASK = 7 };
+
+    int lfd;
+    Uring ring;
+    bool multishot = true;          // falls back to one accept per entry
+    uint64_t done_count = 0;
+    __kernel_timespec tick{1, 0};
+    unordered_map<TcpConn*, unique_ptr<TcpConn>> closing;
+
+    void arm_accept(){
+        io_uring_sqe* s = ring.sqe();
+        s->opcode = IORING_OP_ACCEPT;
+        s->fd = lfd;
+        if(multishot) s->ioprio = IORING_ACCEPT_MULTISHOT;
+        s->user_data = U_ACCEPT;
+    }
+
+    void arm_done(){
+        io_uring_sqe* s = ring.sqe();
+        s->opcode = IORING_OP_READ;
+        s->fd = done_fd;
+        s->addr = (uint64_t)&done_count;
+        s->len = sizeof(done_count);
+        s->user_data = U_DONE;
+    }
+
+    void arm_tick(){
+        io_uring_sqe* s = ring.sqe();
+        s->opcode = IORING_OP_TIMEOUT;
+        s->addr = (uint64_t)&tick;
+        s->len = 1;
+        s->user_data = U_TICK;
+    }
+
+    // Receives the rest of the current part in place if it is large or
+    // no provided buffer is left, otherwise into a provided buffer.
+    void arm_recv(TcpConn* c, bool in_place){
+        auto [buf, len] = tcp_part(*c);
+        io_uring_sqe* s = ring.sqe();
+        s->opcode = IORING_OP_RECV;
+        s->fd = c->fd;
+        if(in_place || len - c->done >= URING_BUF_SIZE){
+            s->addr = (uint64_t)(buf + c->done);
+            s->len  = len - c->done;
+        } else {
+            s->flags = IOSQE_BUFFER_SELECT;
+            s->buf_group = URING_BGID;
+            s->len = URING_BUF_SIZE;
+        }
+        s->user_data = (uint64_t)c | U_RECV;
+        c->recv_armed = true;
+        c->io_pending++;
+    }
+
+    void arm_send(TcpConn* c){
+        auto& out = c->outq.front();
+        io_uring_sqe* s = ring.sqe();
+        s->opcode = IORING_OP_SEND;
+        s->fd = c->fd;
+        s->addr = (uint64_t)(out.data() + c->out_done);
+        s->len  = out.size() - c->out_done;
+        s->msg_flags = MSG_NOSIGNAL;
+        s->user_data = (uint64_t)c | U_SEND;
+        c->send_armed = true;
+        c->io_pending++;
+    }
+
+    void complete(const io_uring_cqe& e){
+        uint64_t tag = e.user_data & U_MASK;
+        if(tag == U_ACCEPT){
+            on_accept(e);
+            return;
+        }
+        if(tag == U_DONE){
+            deliver_done();
+            arm_done();
+            return;
+        }
+        if(tag == U_TICK){
+            sweep(chrono::steady_clock::now());
+            arm_tick();
+            return;
+        }
+
+        TcpConn* c = (TcpConn*)(e.user_data & ~U_MASK);
+        c->io_pending--;
+        if(tag == U_RECV) c->recv_armed = false;
+        else              c->send_armed = false;
+
+        if(c->fd < 0){                         // closed while this was pending
+            if(e.flags & IORING_CQE_F_BUFFER) ring.recycle(e.flags >> IORING_CQE_BUFFER_SHIFT);
+            if(!c->io_pending) closing.erase(c);
+            return;
+        }
+        if(tag == U_RECV ? on_recv(c, e) : on_sent(c, e)) update(c);
+    }
+
+    void on_accept(const io_uring_cqe& e){
+        if(e.res >= 0){
+            if(TcpConn* c = admit(e.res)) update(c);
+        }
+        else if(e.res == -EINVAL && multishot){
+            LOG_INFO("[TCP] multishot accept unsupported, accepting one at a time");
+            multishot = false;
+        }
+        if(!(e.flags & IORING_CQE_F_MORE)) arm_accept();
+    }
+
+    // Returns false if the connection was closed.
+    bool on_recv(TcpConn* c, const io_uring_cqe& e){
+        if(e.res == -ENOBUFS){
+            arm_recv(c, true);
+            return true;
+        }
+        if(e.res < 0){
+            if(e.res == -EINTR || e.res == -EAGAIN) return true;
+            drop(c);
+            return false;
+        }
+        if(e.res == 0){
+            // Peer finished sending; still answer what it already sent.
+            c->st = TCP_NO_READ;
+            return true;
+        }
+
+        c->last = chrono::steady_clock::now();
+        if(e.flags & IORING_CQE_F_BUFFER){
+            unsigned bid = e.flags >> IORING_CQE_BUFFER_SHIFT;
+            feed(c, ring.buffer(bid), e.res);
+            ring.recycle(bid);
+        } else {
+            c->done += e.res;
+            feed(c, nullptr, 0);
+        }
+        return true;
+    }
+
+    bool on_sent(TcpConn* c, const io_uring_cqe& e){
+        if(e.res < 0){
+            if(e.res == -EINTR || e.res == -EAGAIN) return true;
+            drop(c);
+            return false;
+        }
+        c->last = chrono::steady_clock::now();
+        c->out_done += e.res;
+        if(c->out_done == c->outq.front().size()) tcp_sent(*c);
+        return true;
+    }
+
+    // Runs the request state machine over n received bytes and over any
+    // parts already complete. Bytes past a request that cannot start yet
+    // (TCP_MAX_INFLIGHT) wait in the stash.
+    void feed(TcpConn* c, const char* p, size_t n){
+        while(c->st < TCP_REQ_DONE && c->inflight < TCP_MAX_INFLIGHT){
+            auto [buf, len] = tcp_part(*c);
+            if(c->done < len){
+                if(!n) break;
+                size_t k = min(n, len - c->done);
+                memcpy(buf + c->done, p, k);
+                c->done += k;
+                p += k;
+                n -= k;
+                if(c->done < len) break;
+            }
+            tcp_part_done(*c);
+            if(c->st == TCP_REQ_DONE) dispatch(c);
+        }
+        if(n && c->st < TCP_REQ_DONE) c->stash.insert(c->stash.end(), p, p + n);
+    }
+
+    // Sending is armed by update().
+    bool flush(TcpConn*){ return true; }
+
+    // Queues the operations the connection is waiting on, or closes it
+    // once it will never read again and has nothing left to send.
+    // Returns false if the connection was closed.
+    bool update(TcpConn* c){
+        if(c->st == TCP_NO_READ){
+            c->stash.clear();
+            if(c->inflight == 0 && c->outq.empty() && !c->send_armed){
+                drop(c);
+                return false;
+            }
+        }
+
+        bool can_read = c->st < TCP_REQ_DONE && c->inflight < TCP_MAX_INFLIGHT;
+        if(can_read && !c->recv_armed){
+            if(!c->stash.empty()){
+                vector<char> st;
+                st.swap(c->stash);
+                feed(c, st.data(), st.size());
+                return update(c);
+            }
+            arm_recv(c, false);
+        }
+        if(!c->outq.empty() && !c->send_armed) arm_send(c);
+        return true;
+    }
+
+    void drop(TcpConn* c){
+        shutdown(c->fd, SHUT_RDWR);   // completes its pending recv/send
+        close(c->fd);
+        auto own = forget(c);
+        c->fd = -1;
+        if(c->io_pending) closing[c] = move(own);
+    }
+};
+
+enum TcpIo { IO_EPOLL, IO_URING };
+TcpIo TCP_IO = IO_EPOLL;
+
+bool parse_io(const string& s, TcpIo& k){
+    if(s == "epoll") k = IO_EPOLL;
+    else if(s == "uring") k = IO_URING;
+    else return false;
+    return true;
+}
+
+// Runs the TCP front end on the chosen backend. io_uring falls back to
+// epoll when the kernel lacks it or an operation it needs.
+void tcp_serve(int lfd){
+    if(TCP_IO == IO_URING){
+        if(UringTcpServer::available()){
+            LOG_INFO("TCP backend: io_uring");
+            UringTcpServer srv(lfd);
+            srv.run();
+            return;
+        }
+        LOG_WARN("io_uring not available, TCP backend: epoll");
+    }
+    TcpServer srv(lfd);
+    srv.run();
+}
+
+/*==========================================================================
+ * BUFFER POOL (SIZE-CLASS SLABS)
+ *==========================================================================*/
+
+// Recycles the flat buffers UDP sessions receive into. Sizes round up to
+// a power of two; each class keeps a short free list, so steady traffic
+// stops allocating while a burst cannot pin memory beyond POOL_MAX_BYTES.
+size_t POOL_MAX_BYTES = 64u << 20;
+const size_t POOL_KEEP = 16;           // free buffers kept per class
+
+class BufferPool {
+public:
+    BufferPool(){
+        for(auto& c : classes) c.free.reserve(POOL_KEEP);
+    }
 
-struct PathResult {
-    long long dist;
-    vector<int> path;
-    bool ok;
-};
+    void* get(size_t bytes, size_t& cap){
+        int k = size_class(bytes);
+        cap = (size_t)1 << k;
+        Class& c = classes[k];
+        {
+            lock_guard<mutex> lk(c.mu);
+            if(!c.free.empty()){
+                void* p = c.free.back();
+                c.free.pop_back();
+                cached -= cap;
+                return p;
+            }
+        }
+        fresh++;
+        return ::operator new(cap);
+    }
 
-PathResult dijkstra(int n, vector<vector<pair<int,int>>>& adj, int S, int T){
-    vector<long long> dist(n, INF);
-    vector<int> parent(n, -1);
-
-    dist[S] = 0;
-    priority_queue<pair<long long,int>, vector<pair<long long,int>>, greater<>> pq;
-    pq.push({0, S});
-
-    while(!pq.empty()){
-        auto [d,u] = pq.top();
-        pq.pop();
-        if(d != dist[u]) continue;
-        if(u == T) break;
-
-        for(auto &ed: adj[u]){
-            int v = ed.first;
-            int w = ed.second;
-            if(dist[v] > dist[u] + w){
-                dist[v] = dist[u] + w;
-                parent[v] = u;
-                pq.push({dist[v], v});
+    void put(void* p, size_t cap){
+        Class& c = classes[__builtin_ctzll(cap)];
+        {
+            lock_guard<mutex> lk(c.mu);
+            if(c.free.size() < POOL_KEEP && cached + cap <= POOL_MAX_BYTES){
+                c.free.push_back(p);
+                cached += cap;
+                return;
             }
         }
+        ::operator delete(p);
     }
 
-    PathResult R;
-    if(dist[T] == INF){
-        R.ok = false;
-        return R;
+    atomic<uint64_t> fresh{0};     // buffers that had to be allocated
+
+private:
+    struct Class {
+        mutex mu;
+        vector<void*> free;
+    };
+    Class classes[64];
+    atomic<size_t> cached{0};
+
+    static int size_class(size_t bytes){
+        if(bytes <= 64) return 6;
+        return 64 - __builtin_clzll(bytes - 1);
+    }
+};
+
+BufferPool buffer_pool;
+
+// Fixed-size array of trivially copyable T backed by the pool. Move-only;
+// the memory goes back to the pool when the owner is destroyed.
+template<class T>
+class PoolBuf {
+    static_assert(is_trivially_copyable<T>::value, "PoolBuf holds raw memory");
+public:
+    PoolBuf() = default;
+    explicit PoolBuf(size_t n) : n(n) {
+        if(n) p = (T*)buffer_pool.get(n * sizeof(T), cap);
+    }
+    PoolBuf(PoolBuf&& o) noexcept { swap(o); }
+    PoolBuf& operator=(PoolBuf&& o) noexcept {
+        PoolBuf t(move(o));
+        swap(t);
+        return *this;
     }
+    ~PoolBuf(){ if(p) buffer_pool.put(p, cap); }
+
+    T* data() const { return p; }
+    size_t size() const { return n; }
+    size_t bytes() const { return cap; }
+    T& operator[](size_t i) const { return p[i]; }
+    void zero(){ if(p) memset((void*)p, 0, n * sizeof(T)); }
+
+    void swap(PoolBuf& o) noexcept {
+        std::swap(p, o.p);
+        std::swap(n, o.n);
+        std::swap(cap, o.cap);
+    }
+
+private:
+    T* p = nullptr;
+    size_t n = 0, cap = 0;
+};
+
+/*==========================================================================
+ * UDP BUFFER (RELIABLE)
+ *==========================================================================*/
+
+struct Udbuf {
+    sockaddr_in addr;
+    int n=-1, m=-1, S=-1, T=-1;
+    int enc=ENC_MATRIX;
+    bool have_header=false;
+    bool have_weights=false;
+    int received_rows=0;
 
-    R.ok = true;
-    R.dist = dist[T];
-    int x = T;
+    PoolBuf<int> mat;              // n*m row-major matrix, then m weights;
+                                   // rows land at their final offset
+    PoolBuf<char> row_seen;
+    PoolBuf<Edge> edges;           // ENC_EDGES sessions
+    PoolBuf<char> edge_seen;
+    int received_edges=0;
 
-    while(x != -1){
-        R.path.push_back(x);
-        x = parent[x];
+    uint64_t last_tick = 0;        // last packet, in udp_tick() units
+    uint64_t timer_gen = 0;        // armed idle timer, 0 = none yet
+    chrono::steady_clock::time_point started;   // first packet
+
+    int* weights() const { return mat.data() + (size_t)n * m; }
+    size_t bytes() const {
+        return mat.bytes() + row_seen.bytes() + edges.bytes() + edge_seen.bytes();
+    }
+
+    bool complete() const {
+        return have_header &&
+            (enc == ENC_EDGES ? received_edges == m
+                              : have_weights && received_rows == n);
     }
-    reverse(R.path.begin(), R.path.end());
-    return R;
+};
+
+// Sessions are keyed by their CID: its 8 characters packed into a
+// uint64, which round-trips to the exact text for replies and needs no
+// string allocation per packet.
+uint64_t cid_key(const char* cid){
+    uint64_t k;
+    memcpy(&k, cid, 8);
+    return k;
 }
 
-vector<vector<pair<int,int>>> build_adj(int n, int m, const vector<int>& flat, const vector<int>& W){
-    vector<vector<pair<int,int>>> adj(n);
+string cid_text(uint64_t k){
+    return string((const char*)&k, 8);
+}
 
-    for(int e=0; e<m; e++){
-        int a=-1, b=-1;
-        for(int v=0; v<n; v++){
-            int val = flat[v*m + e];
-            if(val != 0){
-                if(a == -1) a = v;
-                else if(b == -1) b = v;
-                else { a = -2; break; } // invalid
-            }
+const int UDP_TICK_MS = 100;   // session clock: udp_tick() units
+const int UDP_DONE_S  = 10;    // how long a solved session still answers a FIN
+const uint64_t UDP_DONE_TICKS = UDP_DONE_S * 1000 / UDP_TICK_MS;
+
+// Session table split into independently locked shards, so packets of
+// different sessions rarely contend for a lock. Each shard also keeps
+// its recently solved CIDs for UDP_DONE_S, with the reply they got, so
+// a FIN that arrives after the worker took the session is answered
+// instead of starting the upload over.
+class SessionTable {
+public:
+    // Locks the session's shard into lk and returns the session. An
+    // unknown CID gets a new empty session if create is set, else null.
+    Udbuf* acquire(uint64_t cid, unique_lock<mutex>& lk, bool create){
+        Shard& s = shard(cid);
+        lk = unique_lock<mutex>(s.mu);
+        if(create) return &s.map[cid];
+        auto it = s.map.find(cid);
+        return it == s.map.end() ? nullptr : &it->second;
+    }
+
+    // Removes the session and moves it into out. False if there is none.
+    bool take(uint64_t cid, Udbuf& out){
+        Shard& s = shard(cid);
+        lock_guard<mutex> lk(s.mu);
+        auto it = s.map.find(cid);
+        if(it == s.map.end()) return false;
+        out = move(it->second);
+        s.map.erase(it);
+        return true;
+    }
+
+    // Caller holds the shard lock from acquire().
+    void erase_locked(uint64_t cid){ shard(cid).map.erase(cid); }
+
+    // Records cid as solved at tick; an empty reply means the worker has
+    // it but has not answered yet. The _locked form is for acquire()rs.
+    void done(uint64_t cid, vector<uint8_t> reply, uint64_t tick){
+        Shard& s = shard(cid);
+        lock_guard<mutex> lk(s.mu);
+        done_locked(cid, move(reply), tick);
+    }
+
+    void done_locked(uint64_t cid, vector<uint8_t> reply, uint64_t tick){
+        Shard& s = shard(cid);
+        while(!s.done_order.empty() && s.done_order.front().first + UDP_DONE_TICKS < tick){
+            auto [t, old] = s.done_order.front();
+            auto it = s.done.find(old);
+            if(it != s.done.end() && it->second.tick == t) s.done.erase(it);
+            s.done_order.pop_front();
         }
-        if(a < 0 || b < 0) continue;
+        s.done[cid] = {tick, move(reply)};
+        s.done_order.push_back({tick, cid});
+    }
 
-        int w = W[e];
-        if(w < 0) w = -w;
+    // Caller holds the shard lock. The reply of a recently solved cid
+    // (empty while it is being solved), or null.
+    const vector<uint8_t>* find_done_locked(uint64_t cid, uint64_t tick){
+        Shard& s = shard(cid);
+        auto it = s.done.find(cid);
+        if(it == s.done.end() || it->second.tick + UDP_DONE_TICKS < tick) return nullptr;
+        return &it->second.reply;
+    }
 
-        adj[a].push_back({b, w});
-        adj[b].push_back({a, w});
+    // For a fired idle timer: erases the session if its last packet is at
+    // or before tick cutoff, adding its buffer bytes to freed. Returns
+    // false, with the last packet tick, if the session is still active.
+    // A session solved or re-created since the timer was armed is left
+    // alone (true, nothing freed).
+    bool expire(uint64_t cid, uint64_t gen, uint64_t cutoff, uint64_t& last, size_t& freed){
+        Shard& s = shard(cid);
+        lock_guard<mutex> lk(s.mu);
+        auto it = s.map.find(cid);
+        if(it == s.map.end() || it->second.timer_gen != gen) return true;
+        if(it->second.last_tick > cutoff){
+            last = it->second.last_tick;
+            return false;
+        }
+        freed = it->second.bytes() + sizeof(Udbuf);
+        s.map.erase(it);
+        return true;
     }
-    return adj;
-}
+
+private:
+    static const int SHARDS = 64;
+    struct Done {
+        uint64_t tick;
+        vector<uint8_t> reply;
+    };
+    struct alignas(64) Shard {
+        mutex mu;
+        unordered_map<uint64_t, Udbuf> map;
+        unordered_map<uint64_t, Done> done;
+        deque<pair<uint64_t, uint64_t>> done_order;   // (tick, cid), oldest first
+    };
+    Shard shards[SHARDS];
+
+    Shard& shard(uint64_t cid){ return shards[mix64(cid) % SHARDS]; }
+};
 
 /*==========================================================================
- * TCP HANDLING (LIMIT 3 CLIENTS)
+ * UDP BATCHED I/O (RECVMMSG / SENDMMSG)
  *==========================================================================*/
 
-atomic<int> tcp_clients{0};
-const int TCP_LIMIT = 3;
+const int    UDP_BATCH     = 64;     // datagrams per recvmmsg/sendmmsg call
+const size_t UDP_MAX_DGRAM = 65536;  // largest UDP payload, so nothing truncates
+const size_t UDP_NACK_MAX  = 4096;   // NACKs stay small enough for any client
 
-void handle_tcp(int client){
-    if(tcp_clients.fetch_add(1) >= TCP_LIMIT){
-        tcp_clients--;
-        GraphResponse resp{};
-        resp.error_code = 1;
-        strcpy(resp.message, "Server busy: too many TCP clients");
-        send(client, &resp, sizeof(resp), 0);
-        close(client);
-        return;
-    }
+struct UdpDatagram {
+    sockaddr_in to;
+    vector<uint8_t> data;
+    chrono::steady_clock::time_point posted{};   // worker replies: handed to UdpOutbox
+};
 
-    GraphRequest req{};
-    if(recv(client, &req, sizeof(req), MSG_WAITALL) != sizeof(req)){
-        close(client);
-        tcp_clients--;
-        return;
+UdpDatagram udp_text(const sockaddr_in& to, const string& s){
+    return {to, vector<uint8_t>(s.begin(), s.end())};
+}
+
+// Sends and clears q, up to UDP_BATCH datagrams per sendmmsg. A datagram
+// the kernel refuses is dropped, as a failed sendto would be.
+void udp_send_all(int udp, vector<UdpDatagram>& q){
+    mmsghdr msgs[UDP_BATCH];
+    iovec iov[UDP_BATCH];
+
+    size_t i = 0;
+    while(i < q.size()){
+        int k = min(q.size() - i, (size_t)UDP_BATCH);
+        for(int j=0;j<k;j++){
+            auto& d = q[i + j];
+            iov[j] = {d.data.data(), d.data.size()};
+            msgs[j] = {};
+            msgs[j].msg_hdr.msg_name    = &d.to;
+            msgs[j].msg_hdr.msg_namelen = sizeof(d.to);
+            msgs[j].msg_hdr.msg_iov     = &iov[j];
+            msgs[j].msg_hdr.msg_iovlen  = 1;
+        }
+
+        int sent = sendmmsg(udp, msgs, k, 0);
+        if(sent < 0){
+            if(errno != EINTR) i++;
+            continue;
+        }
+        metrics.add(M_UDP_TX_CALLS);
+        metrics.add(M_UDP_TX_PKTS, sent);
+        i += sent;
     }
+    q.clear();
+}
 
-    GraphResponse resp{};
-    resp.error_code = 1;
+// Replies produced on worker threads. One sender thread drains them, so
+// results finishing together leave in a single sendmmsg.
+class UdpOutbox {
+public:
+    void start(int fd){
+        udp = fd;
+        thread([this](){ run(); }).detach();
+    }
 
-    if(!valid_nm(req.vertices, req.edges)){
-        strcpy(resp.message, "n/m invalid.");
-        send(client, &resp, sizeof(resp), 0);
-        close(client);
-        tcp_clients--;
-        return;
+    void post(UdpDatagram d){
+        d.posted = chrono::steady_clock::now();
+        {
+            lock_guard<mutex> lk(mu);
+            q.push_back(move(d));
+        }
+        cv.notify_one();
     }
 
-    int n = req.vertices, m = req.edges;
-    int S = req.start_node, T = req.end_node;
+private:
+    int udp = -1;
+    mutex mu;
+    condition_variable cv;
+    vector<UdpDatagram> q;
 
-    if(S < 0 || S >= n || T < 0 || T >= n){
-        strcpy(resp.message, "Start/end invalid.");
-        send(client, &resp, sizeof(resp), 0);
-        close(client);
-        tcp_clients--;
-        return;
+    void run(){
+        vector<UdpDatagram> batch;
+        vector<chrono::steady_clock::time_point> posted;
+        while(true){
+            {
+                unique_lock<mutex> lk(mu);
+                cv.wait(lk, [&]{ return !q.empty(); });
+                batch.swap(q);
+            }
+            posted.clear();
+            for(auto& d : batch) posted.push_back(d.posted);
+            udp_send_all(udp, batch);
+
+            auto now = chrono::steady_clock::now();
+            for(auto t : posted) metrics.observe(TR_UDP, PH_SEND, now - t);
+        }
     }
+};
+
+/*==========================================================================
+ * UDP SESSION EXPIRY (HIERARCHICAL TIMER WHEEL)
+ *==========================================================================*/
 
-    vector<int> mat(n*m);
-    vector<int> W(m);
+// Two-level timing wheel: 256 one-tick slots, then 64 slots of 256 ticks
+// each. Scheduling and firing are O(1); a level-1 slot is cascaded into
+// level 0 once per 256 ticks. Deadlines beyond both levels park in the
+// farthest slot and are re-filed when it comes round. Not thread-safe:
+// the receive loop that owns it does all scheduling and ticking.
+class TimerWheel {
+public:
+    struct Timer {
+        uint64_t id, gen;   // session and the arming it belongs to
+        uint64_t due;       // tick
+    };
 
-    ssize_t needMat = n*m*sizeof(int);
-    ssize_t needW   = m*sizeof(int);
+    explicit TimerWheel(uint64_t now) : cur(now) {}
 
-    if(recv(client, mat.data(), needMat, MSG_WAITALL) != needMat ||
-       recv(client, W.data(), needW, MSG_WAITALL) != needW)
-    {
-        close(client);
-        tcp_clients--;
-        return;
+    void schedule(const Timer& t){
+        uint64_t due = max(t.due, cur + 1);
+        if(due - cur < L0)
+            l0[due % L0].push_back(t);
+        else if(due - cur < L0 * L1)
+            l1[(due / L0) % L1].push_back(t);
+        else
+            l1[(cur / L0 + L1 - 1) % L1].push_back(t);
     }
 
-    /* Validate columns exactly 2 non-zero entries */
-    for(int e=0; e<m; e++){
-        int cnt=0, pos=-1, neg=-1;
-        for(int v=0; v<n; v++){
-            int val = mat[v*m+e];
-            if(val != 0){
-                cnt++;
-                if(val > 0) pos=v;
-                else        neg=v;
+    // Advances to tick now, calling fire(timer) for every timer due.
+    template<class F>
+    void advance(uint64_t now, F fire){
+        vector<Timer> slot;
+        while(cur < now){
+            cur++;
+            if(cur % L0 == 0){                // cascade the next level-1 slot
+                slot.swap(l1[(cur / L0) % L1]);
+                for(auto& t : slot) schedule_or_fire(t, fire);
+                slot.clear();
             }
-        }
-        if(cnt != 2 || pos==-1 || neg==-1){
-            strcpy(resp.message, "Invalid incidence matrix");
-            send(client,&resp,sizeof(resp),0);
-            close(client);
-            tcp_clients--;
-            return;
+            slot.swap(l0[cur % L0]);
+            for(auto& t : slot) schedule_or_fire(t, fire);
+            slot.clear();
         }
     }
 
-    auto adj = build_adj(n,m,mat,W);
-    auto R = dijkstra(n,adj,S,T);
-
-    if(!R.ok){
-        resp.error_code=1;
-        resp.path_length=-1;
-        strcpy(resp.message,"No path found");
-    } else {
-        resp.error_code = 0;
-        resp.path_length = R.dist;
-        resp.path_size   = R.path.size();
-        strcpy(resp.message, "OK");
+private:
+    static const uint64_t L0 = 256, L1 = 64;
+    vector<Timer> l0[L0], l1[L1];
+    uint64_t cur;
 
-        for(int i=0;i<R.path.size() && i<64;i++)
-            resp.path[i] = R.path[i];
+    template<class F>
+    void schedule_or_fire(const Timer& t, F& fire){
+        if(t.due <= cur) fire(t);
+        else schedule(t);
     }
+};
 
-    send(client, &resp, sizeof(resp), 0);
-    close(client);
-    tcp_clients--;
-}
+int UDP_SESSION_TIMEOUT_S = 30;         // idle time before a session is dropped
 
-/*==========================================================================
- * UDP BUFFER (RELIABLE)
- *==========================================================================*/
+const chrono::steady_clock::time_point udp_epoch = chrono::steady_clock::now();
 
-struct Udbuf {
-    sockaddr_in addr;
-    int n=-1, m=-1, S=-1, T=-1;
-    bool have_header=false;
-    bool have_weights=false;
-    int received_rows=0;
+uint64_t udp_tick(chrono::steady_clock::time_point t){
+    return chrono::duration_cast<chrono::milliseconds>(t - udp_epoch).count() / UDP_TICK_MS;
+}
+
+uint64_t udp_timeout_ticks(){
+    return (uint64_t)UDP_SESSION_TIMEOUT_S * 1000 / UDP_TICK_MS;
+}
 
-    vector<vector<int>> rows;
-    vector<int> weights;
+// One UDP socket and what its receive thread owns. With --udp-threads N
+// there are N of them on SO_REUSEPORT sockets; the kernel hashes each
+// client's 4-tuple to one socket, so all packets of a session reach the
+// same receiver and the session lives in that receiver's table and wheel.
+struct UdpReceiver {
+    int fd = -1;
+    int index = 0;
+    SessionTable sessions;
+    TimerWheel timers{0};
+    uint64_t timer_gen = 0;
+    UdpOutbox out;              // worker replies, sent on fd
 };
 
-mutex U_m;
-unordered_map<string, Udbuf> U;
+int UDP_THREADS = 1;
+
+// Called by the receive loop for a fired idle timer. A session that saw
+// traffic since it was armed gets a new deadline instead of expiring, so
+// packets never touch the wheel.
+void udp_timer_fired(UdpReceiver& rx, const TimerWheel::Timer& t){
+    size_t freed = 0;
+    uint64_t last;
+    if(rx.sessions.expire(t.id, t.gen, t.due - udp_timeout_ticks(), last, freed)){
+        if(freed){
+            metrics.add(M_UDP_EXPIRED);
+            metrics.add(M_UDP_RECLAIMED, freed);
+            LOG_DEBUG("[UDP] session %.8s expired, %zu bytes reclaimed",
+                      cid_text(t.id).c_str(), freed);
+        }
+        return;
+    }
+    rx.timers.schedule({t.id, t.gen, last + udp_timeout_ticks()});
+}
 
 /*==========================================================================
  * UDP PROCESSOR
  *==========================================================================*/
 
-atomic<int> udp_tasks{0};
-const int UDP_LIMIT = 3;
+atomic<int> udp_tasks{0};   // sessions currently being solved
 
-void udp_process(const string& cid, int udp){
-    if(udp_tasks.fetch_add(1) >= UDP_LIMIT){
-        udp_tasks--;
-        return;
-    }
+void udp_process(UdpReceiver& rx, uint64_t id){
+    udp_tasks++;
 
+    string cid = cid_text(id);
     Udbuf buf;
-    {
-        lock_guard<mutex> lk(U_m);
-        buf = U[cid];
-        U.erase(cid);
+    if(!rx.sessions.take(id, buf)){   // a FIN resent before the take: solved once
+        udp_tasks--;
+        return;
     }
+    metrics.add(M_UDP_REQUESTS);
 
-    if(!buf.have_header || !buf.have_weights || buf.received_rows != buf.n){
-        string err = cid + " ERROR Incomplete data";
-        sendto(udp, err.c_str(), err.size(), 0, 
-               (sockaddr*)&buf.addr, sizeof(buf.addr));
+    // every answer is kept for a late FIN, then sent
+    auto reply = [&](UdpDatagram d){
+        rx.sessions.done(id, d.data, udp_tick(chrono::steady_clock::now()));
+        rx.out.post(move(d));
+    };
+    auto fail = [&](const char* why){
+        reply(udp_text(buf.addr, cid + " ERROR " + why));
+        metrics.add(M_UDP_ERRORS);
         udp_tasks--;
+    };
+
+    if(!buf.complete()){
+        fail("Incomplete data");
         return;
     }
 
     int n=buf.n, m=buf.m, S=buf.S, T=buf.T;
+    CacheKey key = buf.enc == ENC_EDGES
+        ? edges_key(n, m, S, T, buf.edges.data())
+        : matrix_key(n, m, S, T, buf.mat.data(), buf.weights());
 
-    // Flatten
-    vector<int> flat(n*m);
-    for(int i=0;i<n;i++)
-        for(int j=0;j<m;j++)
-            flat[i*m+j] = buf.rows[i][j];
-
-    // Validate each column
-    for(int e=0;e<m;e++){
-        int cnt=0,pos=-1,neg=-1;
-        for(int v=0;v<n;v++){
-            int val = flat[v*m+e];
-            if(val!=0){
-                cnt++;
-                if(val>0) pos=v;
-                else      neg=v;
-            }
-        }
-        if(cnt!=2 || pos==-1 || neg==-1){
-            string err = cid + " ERROR Invalid incidence col";
-            sendto(udp,err.c_str(),err.size(),0,
-                   (sockaddr*)&buf.addr,sizeof(buf.addr));
-            udp_tasks--;
+    PathResult R;
+    if(auto hit = results.get(key)) R = *hit;
+    else {
+        // decoded edges of a matrix session; reused by this worker
+        thread_local vector<Edge> decoded;
+        const Edge* edges = buf.edges.data();
+
+        const char* bad = timed(TR_UDP, PH_VALIDATE, [&]() -> const char* {
+            if(buf.enc == ENC_EDGES)
+                return valid_edges(n, edges, m) ? nullptr : "Invalid edge list";
+            // Validate each column
+            if(!incidence_to_edges(n, m, buf.mat.data(), buf.weights(), decoded))
+                return "Invalid incidence col";
+            edges = decoded.data();
+            return nullptr;
+        });
+        if(bad){
+            fail(bad);
             return;
         }
-    }
 
-    auto adj = build_adj(n,m,flat,buf.weights);
-    auto R = dijkstra(n,adj,S,T);
+        auto g = timed(TR_UDP, PH_BUILD, [&]{ return build_csr(n, edges, m); });
+        R = timed(TR_UDP, PH_SEARCH, [&]{ return shortest_path(g,S,T,SEARCH_KIND); });
+        results.put(key, R);
+    }
 
     if(!R.ok){
-        string err = cid + " ERROR No Path";
-        sendto(udp,err.c_str(),err.size(),0,
-               (sockaddr*)&buf.addr,sizeof(buf.addr));
-        udp_tasks--;
+        fail("No Path");
         return;
     }
 
@@ -304,134 +2622,642 @@ void udp_process(const string& cid, int udp){
     put((int32_t)R.path.size());
     for(int v : R.path) put(v);
 
-    sendto(udp, out.data(), out.size(), 0,
-           (sockaddr*)&buf.addr, sizeof(buf.addr));
+    reply({buf.addr, move(out)});
 
     udp_tasks--;
 }
 
 /*==========================================================================
- * MAIN SERVER LOOP
+ * UDP PACKET HANDLING
  *==========================================================================*/
 
-int main(int argc,char**argv){
-    if(argc!=2){
-        cout<<"Usage: ./server <port>\n";
-        return 0;
+UdpDatagram udp_ack(uint64_t id, const sockaddr_in& to){
+    vector<uint8_t> out(sizeof(UdpPacketHeader), 0);
+    UdpPacketHeader* h = (UdpPacketHeader*)out.data();
+    memcpy(h->cid, &id, 8);
+    h->type = UDP_ACK;
+    return {to, move(out)};
+}
+
+UdpDatagram udp_busy(uint64_t id, const sockaddr_in& to, int retry_ms){
+    vector<uint8_t> out(sizeof(UdpPacketHeader) + 4);
+    UdpPacketHeader* h = (UdpPacketHeader*)out.data();
+    memcpy(h->cid, cid_text(id).c_str(), 8);
+    h->cid[8] = 0;
+    h->type = UDP_BUSY;
+    int32_t ms = htonl(retry_ms);
+    memcpy(out.data() + sizeof(UdpPacketHeader), &ms, 4);
+    return {to, move(out)};
+}
+
+// Lists what an incomplete session lacks, starting at its first missing
+// unit and covering as many units as one datagram's bitmap can hold.
+UdpDatagram udp_nack(uint64_t id, const Udbuf& B, const sockaddr_in& to){
+    int units = 0, first = 0;
+    const char* seen = nullptr;
+    if(B.have_header){
+        units = B.enc == ENC_EDGES ? B.m : B.n;
+        seen  = B.enc == ENC_EDGES ? B.edge_seen.data() : B.row_seen.data();
+        while(first < units && seen[first]) first++;
     }
+    const size_t fixed = sizeof(UdpPacketHeader) + 16;
+    int count = min(units - first, (int)((UDP_NACK_MAX - fixed) * 8));
 
-    int PORT = atoi(argv[1]);
+    vector<uint8_t> out(fixed + (count + 7) / 8, 0);
+    UdpPacketHeader* h = (UdpPacketHeader*)out.data();
+    memcpy(h->cid, &id, 8);
+    h->type = UDP_NACK;
 
-    int tcp = socket(AF_INET,SOCK_STREAM,0);
-    int udp = socket(AF_INET,SOCK_DGRAM,0);
+    uint8_t* p = out.data() + sizeof(UdpPacketHeader);
+    auto put = [&](int32_t x){
+        int32_t y = htonl(x);
+        memcpy(p, &y, 4);
+        p += 4;
+    };
+    put(!B.have_header);
+    put(B.have_header && B.enc == ENC_MATRIX && !B.have_weights);
+    put(first);
+    put(count);
+    for(int i=0;i<count;i++)
+        if(!seen[first + i]) p[i / 8] |= 1 << (i % 8);
+    return {to, move(out)};
+}
 
-    sockaddr_in a{};
-    a.sin_family = AF_INET;
-    a.sin_port   = htons(PORT);
-    a.sin_addr.s_addr = INADDR_ANY;
+// Applies one datagram to its session. Replies for the sender go to
+// replies, sent with the rest of the receive batch.
+void udp_packet(UdpReceiver& rx, uint8_t* buf_raw, ssize_t r, const sockaddr_in& from,
+                uint64_t tick, vector<UdpDatagram>& replies){
+    if(r < (ssize_t)sizeof(UdpPacketHeader)) return;
+
+    UdpPacketHeader *h = (UdpPacketHeader*)buf_raw;
+    uint64_t id = cid_key(h->cid);
+
+    LOG_TRACE("[UDP] Received packet type=%d from CID=%.8s size=%zd bytes",
+              (int)h->type, h->cid, r);
+
+    // Only a header opens a session. Anything else for an unknown CID
+    // lost its header, or comes after the session was solved or dropped.
+    unique_lock<mutex> lk;
+    Udbuf* found = rx.sessions.acquire(id, lk, h->type == UDP_HEADER);
+    if(!found){
+        if(h->type != UDP_FIN) return;
+        if(auto done = rx.sessions.find_done_locked(id, tick)){
+            // a late or repeated FIN: the result, or only the ACK while
+            // the worker is still on it
+            replies.push_back(udp_ack(id, from));
+            if(!done->empty()) replies.push_back({from, *done});
+        } else {
+            metrics.add(M_UDP_NACKS);   // start over: the header is missing
+            replies.push_back(udp_nack(id, Udbuf(), from));
+        }
+        return;
+    }
+    Udbuf& B = *found;
+    B.addr = from;
+    B.last_tick = tick;
+    if(!B.timer_gen){
+        B.started = chrono::steady_clock::now();
+        B.timer_gen = ++rx.timer_gen;
+        rx.timers.schedule({id, B.timer_gen, tick + udp_timeout_ticks()});
+    }
 
-    bind(tcp,(sockaddr*)&a,sizeof(a));
-    listen(tcp,10);
+    if(h->type == UDP_HEADER){
+        uint8_t* p = buf_raw + sizeof(UdpPacketHeader);
+        if(r < (ssize_t)(sizeof(UdpPacketHeader) + 4*sizeof(int32_t))) return;
+        int32_t n = ntohl(*(int32_t*)p); p+=4;
+        int32_t m = ntohl(*(int32_t*)p); p+=4;
+        int32_t S = ntohl(*(int32_t*)p); p+=4;
+        int32_t T = ntohl(*(int32_t*)p); p+=4;
+        int32_t enc = ENC_MATRIX;
+        if(r >= (ssize_t)sizeof(UdpPacketHeader) + 20)
+            enc = ntohl(*(int32_t*)p);
+
+        if(!valid_nm(n,m) || S < 0 || S >= n || T < 0 || T >= n ||
+           (enc != ENC_MATRIX && enc != ENC_EDGES)){
+            if(!B.have_header) rx.sessions.erase_locked(id);
+            replies.push_back(udp_text(from, cid_text(id) + " ERROR Invalid n/m"));
+            return;
+        }
+        // a duplicate or resent header must not discard received rows
+        if(B.have_header && B.n == n && B.m == m && B.S == S && B.T == T && B.enc == enc)
+            return;
 
-    bind(udp,(sockaddr*)&a,sizeof(a));
+        // Admission, before the client uploads anything
+        int ms;
+        Admit a = admit_request(ntohl(from.sin_addr.s_addr), ms);
+        if(a != ADMIT_OK){
+            metrics.add(a == ADMIT_RATE ? M_UDP_REJECTED_RATE : M_UDP_REJECTED_QUEUE);
+            LOG_DEBUG("[UDP] session %.8s refused (%s), retry after %d ms",
+                      h->cid, admit_reason(a), ms);
+            rx.sessions.erase_locked(id);
+            replies.push_back(udp_busy(id, from, ms));
+            return;
+        }
 
-    cout<<"Server running on port "<<PORT<<" (TCP + UDP)\n";
+        B.n = n; B.m = m; B.S = S; B.T = T;
+        B.enc = enc;
+        if(enc == ENC_EDGES){
+            B.edges = PoolBuf<Edge>(m);
+            B.edge_seen = PoolBuf<char>(m);
+            B.edge_seen.zero();
+            B.received_edges = 0;
+        } else {
+            B.mat = PoolBuf<int>((size_t)n * m + m);
+            B.mat.zero();
+            B.row_seen = PoolBuf<char>(n);
+            B.row_seen.zero();
+            B.received_rows = 0;
+            B.have_weights = false;
+        }
+        B.have_header = true;
+    }
 
-    // TCP accept loop
-    thread([&](){
-        while(true){
-            sockaddr_in c;
-            socklen_t L=sizeof(c);
-            int cl = accept(tcp,(sockaddr*)&c,&L);
-            if(cl>=0){
-                thread(handle_tcp, cl).detach();
+    else if(h->type == UDP_EDGES){
+        if(!B.have_header || B.enc != ENC_EDGES) return;
+        uint8_t* p = buf_raw + sizeof(UdpPacketHeader);
+        if(r < (ssize_t)sizeof(UdpPacketHeader) + 8) return;
+        int32_t first = ntohl(*(int32_t*)p); p+=4;
+        int32_t count = ntohl(*(int32_t*)p); p+=4;
+
+        if(first < 0 || count < 0 || count > B.m - first) return;
+        if(r < (ssize_t)sizeof(UdpPacketHeader) + 8 + 12*(ssize_t)count) return;
+
+        for(int k=0;k<count;k++){
+            Edge& e = B.edges[first + k];
+            e.u = ntohl(*(int32_t*)p); p+=4;
+            e.v = ntohl(*(int32_t*)p); p+=4;
+            e.w = ntohl(*(int32_t*)p); p+=4;
+            if(!B.edge_seen[first + k]){
+                B.edge_seen[first + k] = 1;
+                B.received_edges++;
             }
         }
-    }).detach();
+    }
 
-    // UDP loop
-    while(true){
-        uint8_t buf_raw[4096];
-        sockaddr_in from; socklen_t L=sizeof(from);
-        ssize_t r = recvfrom(udp, buf_raw, sizeof(buf_raw), 0,
-                             (sockaddr*)&from, &L);
-
-        if(r < (ssize_t)sizeof(UdpPacketHeader)) continue;
-
-        UdpPacketHeader *h = (UdpPacketHeader*)buf_raw;
-        string cid(h->cid, 8);
-
-        cout << "[UDP] Received packet type=" << (int)h->type 
-         << " from CID=" << cid 
-         << " size=" << r << " bytes\n";
-        
-        lock_guard<mutex> lk(U_m);
-        auto &B = U[cid];
-        B.addr = from;
-
-        if(h->type == UDP_HEADER){
-            uint8_t* p = buf_raw + sizeof(UdpPacketHeader);
-            int32_t n = ntohl(*(int32_t*)p); p+=4;
-            int32_t m = ntohl(*(int32_t*)p); p+=4;
-            int32_t S = ntohl(*(int32_t*)p); p+=4;
-            int32_t T = ntohl(*(int32_t*)p); p+=4;
-
-            if(!valid_nm(n,m)){
-                string err = cid + " ERROR Invalid n/m";
-                sendto(udp, err.c_str(), err.size(), 0,
-                       (sockaddr*)&from, sizeof(from));
-                continue;
+    else if(h->type == UDP_CHUNK){
+        if(!B.have_header) return;
+        uint8_t* p = buf_raw + sizeof(UdpPacketHeader);
+        if(r < (ssize_t)sizeof(UdpPacketHeader) + 16) return;
+        int32_t seq   = ntohl(*(int32_t*)p); p+=4;
+        int32_t total = ntohl(*(int32_t*)p); p+=4;
+        int32_t first = ntohl(*(int32_t*)p); p+=4;
+        int32_t count = ntohl(*(int32_t*)p); p+=4;
+
+        bool edges = B.enc == ENC_EDGES;
+        int units = edges ? B.m : B.n + 1;          // matrix unit n = weights
+        size_t unit_ints = edges ? 3 : B.m;
+        if(seq < 0 || seq >= total || first < 0 || count < 0 || count > units - first) return;
+        size_t ints = unit_ints * count;
+        if(r < (ssize_t)(sizeof(UdpPacketHeader) + 16 + 4*ints)) return;
+
+        LOG_TRACE("[UDP] CID=%.8s chunk %d/%d units %d+%d", h->cid, seq, total, first, count);
+
+        // straight to the final offset: rows (and weights) are contiguous
+        // in mat, edges are three ints each
+        static_assert(sizeof(Edge) == 3 * sizeof(int), "Edge is written as three ints");
+        int* dst = edges ? (int*)(B.edges.data() + first)
+                         : B.mat.data() + (size_t)first * B.m;
+        for(size_t i=0;i<ints;i++){
+            dst[i] = ntohl(*(int32_t*)p); p+=4;
+        }
+
+        for(int k=first;k<first+count;k++){
+            if(edges){
+                if(!B.edge_seen[k]){ B.edge_seen[k] = 1; B.received_edges++; }
+            } else if(k == B.n){
+                B.have_weights = true;
+            } else if(!B.row_seen[k]){
+                B.row_seen[k] = 1;
+                B.received_rows++;
             }
+        }
+    }
+
+    else if(h->type == UDP_ROW){
+        if(!B.have_header) return;
+        uint8_t* p = buf_raw + sizeof(UdpPacketHeader);
+        if(r < (ssize_t)sizeof(UdpPacketHeader) + 4 + 4*(ssize_t)B.m) return;
+        int32_t row = ntohl(*(int32_t*)p); p+=4;
+
+        if(row < 0 || row >= B.n) return;
+
+        int* dst = B.mat.data() + (size_t)row * B.m;
+        for(int j=0;j<B.m;j++){
+            dst[j] = ntohl(*(int32_t*)p); p+=4;
+        }
+        if(!B.row_seen[row]){      // a resent row is not new
+            B.row_seen[row] = 1;
+            B.received_rows++;
+        }
+    }
+
+    else if(h->type == UDP_WEIGHTS){
+        if(!B.have_header) return;
+        uint8_t* p = buf_raw + sizeof(UdpPacketHeader);
+        if(r < (ssize_t)sizeof(UdpPacketHeader) + 4 + 4*(ssize_t)B.m) return;
+        int32_t m2 = ntohl(*(int32_t*)p); p+=4;
+
+        if(m2 != B.m) return;
+
+        int* W = B.weights();
+        for(int j=0;j<B.m;j++){
+            W[j] = ntohl(*(int32_t*)p); p+=4;
+        }
+        B.have_weights = true;
+    }
 
-            B.n = n; B.m = m; B.S = S; B.T = T;
-            B.rows.assign(n, vector<int>(m, 0));
-            B.weights.assign(m, 0);
-            B.have_header = true;
+    else if(h->type == UDP_FIN){
+        // Ask for what is missing; the session waits for the resends
+        if(!B.complete()){
+            metrics.add(M_UDP_NACKS);
+            replies.push_back(udp_nack(id, B, from));
+            return;
+        }
+
+        metrics.observe(TR_UDP, PH_RECV, chrono::steady_clock::now() - B.started);
+
+        // Process on the worker pool; a full queue gets UDP_BUSY, not an
+        // ACK, so the client knows to start over
+        if(!pool->submit([&rx, id](){ udp_process(rx, id); })){
+            metrics.add(M_UDP_REJECTED_QUEUE);
+            rx.sessions.erase_locked(id);
+            LOG_WARN("[UDP] solver queue full, session %.8s rejected", h->cid);
+            replies.push_back(udp_busy(id, from, busy_retry_ms(queue_wait_ms(QUEUE_CAP))));
+            return;
         }
+        rx.sessions.done_locked(id, {}, tick);
+
+        // SEND ACK IMMEDIATELY
+        replies.push_back(udp_ack(id, from));
+    }
+}
+
+/*==========================================================================
+ * UDP RECEIVERS (SO_REUSEPORT)
+ *==========================================================================*/
+
+// Keeps the calling thread on one core, so a receiver's socket, session
+// shards and wheel stay in that core's caches.
+static void pin_to_core(int core){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        LOG_WARN("[UDP] could not pin receiver to core %d", core);
+}
+
+// Drains the receiver's socket in batches and answers each batch at once.
+void udp_receive_loop(UdpReceiver& rx){
+    if(UDP_THREADS > 1){
+        int cores = max(1u, thread::hardware_concurrency());
+        pin_to_core(rx.index % cores);
+    }
+    rx.out.start(rx.fd);
+
+    vector<uint8_t> buf(UDP_BATCH * UDP_MAX_DGRAM);
+    mmsghdr msgs[UDP_BATCH];
+    iovec iov[UDP_BATCH];
+    sockaddr_in from[UDP_BATCH];
+    vector<UdpDatagram> replies;
 
-        else if(h->type == UDP_ROW){
-            if(!B.have_header) continue;
-            uint8_t* p = buf_raw + sizeof(UdpPacketHeader);
-            int32_t row = ntohl(*(int32_t*)p); p+=4;
+    // wake up at least once per tick to expire idle sessions
+    timeval tv{0, UDP_TICK_MS * 1000};
+    setsockopt(rx.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-            if(row < 0 || row >= B.n) continue;
+    while(true){
+        for(int j=0;j<UDP_BATCH;j++){
+            iov[j] = {buf.data() + j * UDP_MAX_DGRAM, UDP_MAX_DGRAM};
+            msgs[j] = {};
+            msgs[j].msg_hdr.msg_name    = &from[j];
+            msgs[j].msg_hdr.msg_namelen = sizeof(from[j]);
+            msgs[j].msg_hdr.msg_iov     = &iov[j];
+            msgs[j].msg_hdr.msg_iovlen  = 1;
+        }
 
-            for(int j=0;j<B.m;j++){
-                int32_t val = ntohl(*(int32_t*)p); p+=4;
-                B.rows[row][j] = val;
+        // blocks for the first datagram only, then takes what is queued
+        int k = recvmmsg(rx.fd, msgs, UDP_BATCH, MSG_WAITFORONE, nullptr);
+        uint64_t tick = udp_tick(chrono::steady_clock::now());
+        rx.timers.advance(tick, [&rx](const TimerWheel::Timer& t){ udp_timer_fired(rx, t); });
+        if(k <= 0) continue;
+        metrics.add(M_UDP_RX_CALLS);
+        metrics.add(M_UDP_RX_PKTS, k);
+
+        for(int j=0;j<k;j++){
+            if(msgs[j].msg_hdr.msg_flags & MSG_TRUNC){
+                metrics.add(M_UDP_TRUNCATED);
+                LOG_DEBUG("[UDP] dropped truncated datagram");
+                continue;
             }
-            B.received_rows++;
+            udp_packet(rx, (uint8_t*)iov[j].iov_base, msgs[j].msg_len, from[j], tick, replies);
         }
+        udp_send_all(rx.fd, replies);
+    }
+}
+
+/*==========================================================================
+ * METRICS EXPOSITION (STATS, PROMETHEUS)
+ *==========================================================================*/
+
+string metrics_text(){
+    static const struct { const char* family; const char* help; const char* labels; Counter c; } counters[] = {
+        {"requests_total", "Requests answered by a worker", "transport=\"tcp\"", M_TCP_REQUESTS},
+        {"requests_total", "", "transport=\"udp\"", M_UDP_REQUESTS},
+        {"errors_total", "Requests answered with an error", "transport=\"tcp\"", M_TCP_ERRORS},
+        {"errors_total", "", "transport=\"udp\"", M_UDP_ERRORS},
+        {"rejected_total", "Connections or requests refused as busy", "reason=\"tcp_connections\"", M_TCP_REJECTED_CONN},
+        {"rejected_total", "", "reason=\"tcp_queue\"", M_TCP_REJECTED_QUEUE},
+        {"rejected_total", "", "reason=\"udp_queue\"", M_UDP_REJECTED_QUEUE},
+        {"rejected_total", "", "reason=\"tcp_rate\"", M_TCP_REJECTED_RATE},
+        {"rejected_total", "", "reason=\"udp_rate\"", M_UDP_REJECTED_RATE},
+        {"cache_hits_total", "Result cache hits", "", M_CACHE_HITS},
+        {"cache_misses_total", "Result cache misses", "", M_CACHE_MISSES},
+        {"udp_packets_total", "UDP datagrams", "direction=\"rx\"", M_UDP_RX_PKTS},
+        {"udp_packets_total", "", "direction=\"tx\"", M_UDP_TX_PKTS},
+        {"udp_syscalls_total", "recvmmsg/sendmmsg calls", "direction=\"rx\"", M_UDP_RX_CALLS},
+        {"udp_syscalls_total", "", "direction=\"tx\"", M_UDP_TX_CALLS},
+        {"udp_truncated_total", "UDP datagrams dropped as truncated", "", M_UDP_TRUNCATED},
+        {"udp_nacks_total", "UDP NACKs sent", "", M_UDP_NACKS},
+        {"udp_sessions_expired_total", "Idle UDP sessions dropped", "", M_UDP_EXPIRED},
+        {"udp_reclaimed_bytes_total", "Buffer bytes held by expired UDP sessions", "", M_UDP_RECLAIMED},
+    };
+    static const char* transports[] = {"tcp", "udp"};
+    static const char* phases[] = {"recv", "validate", "build", "search", "send"};
+
+    string out;
+    char line[256];
+    auto header = [&](const char* family, const char* help, const char* type){
+        snprintf(line, sizeof(line), "# HELP graph_server_%s %s\n# TYPE graph_server_%s %s\n",
+                 family, help, family, type);
+        out += line;
+    };
 
-        else if(h->type == UDP_WEIGHTS){
-            if(!B.have_header) continue;
-            uint8_t* p = buf_raw + sizeof(UdpPacketHeader);
-            int32_t m2 = ntohl(*(int32_t*)p); p+=4;
+    for(auto& k : counters){
+        if(*k.help) header(k.family, k.help, "counter");
+        snprintf(line, sizeof(line), "graph_server_%s%s%s%s %llu\n", k.family,
+                 *k.labels ? "{" : "", k.labels, *k.labels ? "}" : "",
+                 (unsigned long long)metrics.total(k.c));
+        out += line;
+    }
 
-            if(m2 != B.m) continue;
+    const pair<const char*, long long> gauges[] = {
+        {"tcp_clients", tcp_clients.load()},
+        {"udp_tasks", udp_tasks.load()},
+        {"queued_jobs", (long long)pool->queued()},
+    };
+    const char* gauge_help[] = {"Open TCP connections", "UDP sessions being solved",
+                                "Jobs waiting for a solver thread"};
+    for(int i=0;i<3;i++){
+        header(gauges[i].first, gauge_help[i], "gauge");
+        snprintf(line, sizeof(line), "graph_server_%s %lld\n", gauges[i].first, gauges[i].second);
+        out += line;
+    }
 
-            for(int j=0;j<B.m;j++){
-                int32_t w = ntohl(*(int32_t*)p); p+=4;
-                B.weights[j] = w;
+    header("phase_seconds", "Time per request phase", "histogram");
+    for(int t=0;t<TR_COUNT;t++)
+        for(int p=0;p<PH_COUNT;p++){
+            uint64_t b[Metrics::HIST_BUCKETS], sum_ns, cum = 0;
+            metrics.histogram((Transport)t, (Phase)p, b, sum_ns);
+            for(int i=0;i<Metrics::HIST_BUCKETS;i++){
+                cum += b[i];
+                char le[32];
+                if(i + 1 < Metrics::HIST_BUCKETS) snprintf(le, sizeof(le), "%.9g", ldexp(1.0, 10 + i) / 1e9);
+                else snprintf(le, sizeof(le), "+Inf");
+                snprintf(line, sizeof(line),
+                         "graph_server_phase_seconds_bucket{transport=\"%s\",phase=\"%s\",le=\"%s\"} %llu\n",
+                         transports[t], phases[p], le, (unsigned long long)cum);
+                out += line;
             }
-            B.have_weights = true;
+            snprintf(line, sizeof(line),
+                     "graph_server_phase_seconds_sum{transport=\"%s\",phase=\"%s\"} %.9f\n"
+                     "graph_server_phase_seconds_count{transport=\"%s\",phase=\"%s\"} %llu\n",
+                     transports[t], phases[p], sum_ns / 1e9,
+                     transports[t], phases[p], (unsigned long long)cum);
+            out += line;
+        }
+    return out;
+}
+
+int METRICS_PORT = 0;   // Prometheus text on 127.0.0.1, 0 = off
+
+// Answers every connection with the metrics as a minimal HTTP/1.0
+// response, whatever it asked for. One scrape at a time is plenty.
+static void metrics_serve(int lfd){
+    while(true){
+        int fd = accept(lfd, nullptr, nullptr);
+        if(fd < 0){
+            if(errno != EINTR) this_thread::sleep_for(chrono::milliseconds(10));
+            continue;
+        }
+        timeval tv{1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        char req[2048];
+        (void)!recv(fd, req, sizeof(req), 0);
+
+        string body = metrics_text();
+        string resp = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: " + to_string(body.size()) + "\r\n"
+                      "Connection: close\r\n\r\n" + body;
+        for(size_t off = 0; off < resp.size(); ){
+            ssize_t r = send(fd, resp.data() + off, resp.size() - off, MSG_NOSIGNAL);
+            if(r < 0 && errno == EINTR) continue;
+            if(r <= 0) break;
+            off += r;
+        }
+        close(fd);
+    }
+}
+
+/*==========================================================================
+ * MAIN SERVER LOOP
+ *==========================================================================*/
+
+int STATS_INTERVAL = 0;   // seconds between stats lines, 0 = off
+
+static void stats_loop(){
+    auto per_call = [](uint64_t pkts, uint64_t calls){ return calls ? (double)pkts / calls : 0.0; };
+    while(true){
+        this_thread::sleep_for(chrono::seconds(STATS_INTERVAL));
+        uint64_t rp = metrics.total(M_UDP_RX_PKTS), rc = metrics.total(M_UDP_RX_CALLS);
+        uint64_t tp = metrics.total(M_UDP_TX_PKTS), tc = metrics.total(M_UDP_TX_CALLS);
+        LOG_INFO("[STATS] udp rx %llu pkts / %llu calls (%.1f/call), "
+                 "tx %llu pkts / %llu calls (%.1f/call); cache %llu hits, %llu misses; "
+                 "pool %llu buffers allocated; %llu sessions expired, %llu bytes reclaimed; "
+                 "%llu nacks, %llu truncated",
+                 (unsigned long long)rp, (unsigned long long)rc, per_call(rp, rc),
+                 (unsigned long long)tp, (unsigned long long)tc, per_call(tp, tc),
+                 (unsigned long long)metrics.total(M_CACHE_HITS),
+                 (unsigned long long)metrics.total(M_CACHE_MISSES),
+                 (unsigned long long)buffer_pool.fresh,
+                 (unsigned long long)metrics.total(M_UDP_EXPIRED),
+                 (unsigned long long)metrics.total(M_UDP_RECLAIMED),
+                 (unsigned long long)metrics.total(M_UDP_NACKS),
+                 (unsigned long long)metrics.total(M_UDP_TRUNCATED));
+    }
+}
+
+static void usage(){
+    cout<<"Usage: ./server <port> [--workers N] [--queue N] [--max-payload MB]\n"
+        <<"                     [--pq auto|binary|dary|radix] [--search dijkstra|bidir|alt]\n"
+        <<"                     [--landmarks K] [--registry-mb MB] [--cache-mb MB]\n"
+        <<"                     [--stats-interval SEC] [--log-level LEVEL]\n"
+        <<"                     [--udp-timeout SEC] [--udp-threads N] [--io epoll|uring]\n"
+        <<"                     [--metrics-port PORT] [--rate-limit QPS] [--rate-burst N]\n"
+        <<"                     [--max-est-wait MS]\n"
+        <<"  --workers N       solver threads (default: number of cores)\n"
+        <<"  --queue N         pending solver jobs before replying busy (default 1024)\n"
+        <<"  --max-est-wait MS reply busy to new requests while the estimated wait,\n"
+        <<"                    queued jobs x mean job time / workers, exceeds MS\n"
+        <<"                    (default 2000, 0 = no estimate); the queue itself\n"
+        <<"                    is bounded by --queue either way\n"
+        <<"  --rate-limit QPS  requests per second per client IP, TCP and UDP\n"
+        <<"                    together, fractions allowed; busy replies past it\n"
+        <<"                    (default unlimited)\n"
+        <<"  --rate-burst N    requests a client may make at once (default: QPS,\n"
+        <<"                    at least 1)\n"
+        <<"  --max-payload MB  largest v2 TCP graph payload accepted (default 256)\n"
+        <<"  --pq KIND         dijkstra queue: lazy binary heap, indexed 4-ary heap\n"
+        <<"                    with decrease-key, radix heap, or auto (default)\n"
+        <<"  --search MODE     default point-to-point search (default dijkstra);\n"
+        <<"                    TCP requests may override it per request. alt only\n"
+        <<"                    applies to registered graphs, others use bidir\n"
+        <<"  --landmarks K     landmarks per graph for ALT (default 8)\n"
+        <<"  --registry-mb MB  memory for graphs uploaded with OP_UPLOAD (default 1024)\n"
+        <<"  --cache-mb MB     memory for cached path results, 0 to disable (default 64)\n"
+        <<"  --stats-interval SEC  log packets per syscall and cache counters\n"
+        <<"  --log-level LEVEL trace|debug|info|warn|error|off (default info);\n"
+        <<"                    trace logs every UDP packet\n"
+        <<"  --udp-timeout SEC idle time before an unfinished UDP session is dropped\n"
+        <<"                    (default 30)\n"
+        <<"  --udp-threads N   UDP sockets on SO_REUSEPORT, each with its own receive\n"
+        <<"                    thread pinned to a core (default 1)\n"
+        <<"  --io BACKEND      TCP I/O: epoll (default) or uring; uring falls back\n"
+        <<"                    to epoll if the kernel does not support it\n"
+        <<"  --metrics-port PORT  serve Prometheus text metrics over HTTP on\n"
+        <<"                    127.0.0.1:PORT (also available as TCP OP_STATS)\n";
+}
+
+int main(int argc,char**argv){
+    if(argc<2){
+        usage();
+        return 0;
+    }
+
+    int PORT = atoi(argv[1]);
+
+    for(int i=2;i<argc;i++){
+        string opt = argv[i];
+        if(i+1 >= argc){ usage(); return 1; }
+
+        if(opt == "--pq"){
+            if(!parse_pq(argv[++i], PQ_KIND)){ usage(); return 1; }
+            continue;
+        }
+        if(opt == "--log-level"){
+            int lvl;
+            if(!parse_log_level(argv[++i], lvl)){ usage(); return 1; }
+            logger.level = lvl;
+            continue;
+        }
+        if(opt == "--io"){
+            if(!parse_io(argv[++i], TCP_IO)){ usage(); return 1; }
+            continue;
+        }
+        if(opt == "--search"){
+            if(!parse_search(argv[++i], SEARCH_KIND)){ usage(); return 1; }
+            continue;
+        }
+
+        if(opt == "--rate-limit" || opt == "--rate-burst"){
+            char* end;
+            double r = strtod(argv[++i], &end);
+            if(*end || !(r > 0) || !isfinite(r) || (opt == "--rate-burst" && r < 1)){ usage(); return 1; }
+            (opt == "--rate-limit" ? RATE_LIMIT : RATE_BURST) = r;
+            continue;
         }
 
-        else if(h->type == UDP_FIN){
-            // SEND ACK IMMEDIATELY
-            vector<uint8_t> ack(sizeof(UdpPacketHeader));
-            UdpPacketHeader *ah = (UdpPacketHeader*)ack.data();
-            memcpy(ah->cid, h->cid, 9);
-            ah->type = UDP_ACK;
+        long val = atol(argv[++i]);
+        if(opt == "--cache-mb" && val >= 0){
+            CACHE_BYTES = (size_t)val << 20;
+            continue;
+        }
+        if(opt == "--max-est-wait" && val >= 0){
+            MAX_EST_WAIT_MS = val;
+            continue;
+        }
+        if(val <= 0){ usage(); return 1; }
+
+        if(opt == "--workers")    WORKERS   = val;
+        else if(opt == "--queue") QUEUE_CAP = val;
+        else if(opt == "--max-payload") MAX_PAYLOAD = (size_t)val << 20;
+        else if(opt == "--landmarks")   ALT_LANDMARKS = val;
+        else if(opt == "--registry-mb") REGISTRY_BYTES = (size_t)val << 20;
+        else if(opt == "--stats-interval") STATS_INTERVAL = val;
+        else if(opt == "--udp-timeout")    UDP_SESSION_TIMEOUT_S = val;
+        else if(opt == "--udp-threads")    UDP_THREADS = val;
+        else if(opt == "--metrics-port")   METRICS_PORT = val;
+        else { usage(); return 1; }
+    }
+
+    logger.start();
+    pool = make_unique<WorkerPool>(WORKERS, QUEUE_CAP);
+
+    int tcp = socket(AF_INET,SOCK_STREAM,0);
+
+    sockaddr_in a{};
+    a.sin_family = AF_INET;
+    a.sin_port   = htons(PORT);
+    a.sin_addr.s_addr = INADDR_ANY;
 
-            sendto(udp, ack.data(), ack.size(), 0,
-                   (sockaddr*)&from, sizeof(from));
+    int one = 1;
+    setsockopt(tcp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(bind(tcp,(sockaddr*)&a,sizeof(a)) < 0 || listen(tcp,SOMAXCONN) < 0){
+        LOG_ERROR("tcp bind/listen: %s", strerror(errno));
+        logger.flush();
+        return 1;
+    }
+    vector<unique_ptr<UdpReceiver>> udp_rx;
+    for(int i=0;i<UDP_THREADS;i++){
+        auto rx = make_unique<UdpReceiver>();
+        rx->index = i;
+        rx->fd = socket(AF_INET,SOCK_DGRAM,0);
+        if(UDP_THREADS > 1)
+            setsockopt(rx->fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        if(bind(rx->fd,(sockaddr*)&a,sizeof(a)) < 0){
+            LOG_ERROR("udp bind: %s", strerror(errno));
+            logger.flush();
+            return 1;
+        }
+        udp_rx.push_back(move(rx));
+    }
 
-            // Process in thread
-            string cid_copy = cid;
-            thread([cid_copy, udp](){ udp_process(cid_copy, udp); }).detach();
+    LOG_INFO("Server running on port %d (TCP + UDP), %zu workers, queue %zu, "
+             "%d UDP receiver(s)", PORT, WORKERS, QUEUE_CAP, UDP_THREADS);
+
+    if(STATS_INTERVAL) thread(stats_loop).detach();
+
+    if(METRICS_PORT){
+        int mfd = socket(AF_INET,SOCK_STREAM,0);
+        sockaddr_in ma{};
+        ma.sin_family = AF_INET;
+        ma.sin_port   = htons(METRICS_PORT);
+        ma.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        setsockopt(mfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(bind(mfd,(sockaddr*)&ma,sizeof(ma)) < 0 || listen(mfd,16) < 0){
+            LOG_ERROR("metrics bind/listen: %s", strerror(errno));
+            logger.flush();
+            return 1;
         }
+        thread(metrics_serve, mfd).detach();
     }
 
+    // TCP event loop
+    thread(tcp_serve, tcp).detach();
+
+    // UDP receivers: the first runs on this thread
+    for(size_t i=1;i<udp_rx.size();i++)
+        thread(udp_receive_loop, ref(*udp_rx[i])).detach();
+    udp_receive_loop(*udp_rx[0]);
+
     return 0;
 }
@@ -0,0 +1,635 @@
+// solver.cpp - graph validation, CSR build and shortest-path search
+// Declarations and the shared types are in solver.h.
+
+#include <bits/stdc++.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "protocol.h"
+#include "solver.h"
+using namespace std;
+
+/*==========================================================================
+ * VALIDATION UTILITIES
+ *==========================================================================*/
+
+bool valid_nm(int n, int m){
+    return (n >= 6 && n < 20 && m >= 6 && m < 20);
+}
+
+// Incidence columns are checked in a row sweep: each row is read once,
+// contiguously, while every column keeps running lanes (non-zeros,
+// positives, last positive row, last negative row). Columns go in tiles
+// whose lanes stay in L1 while the rows stream past, so the row-major
+// wire layout never has to be transposed.
+const int VALIDATE_TILE = 1024;
+
+struct ColumnLanes {
+    alignas(32) int32_t cnt[VALIDATE_TILE];
+    alignas(32) int32_t npos[VALIDATE_TILE];
+    alignas(32) int32_t pos[VALIDATE_TILE];
+    alignas(32) int32_t neg[VALIDATE_TILE];
+};
+
+// Sweeps rows [0, n) of the row-major n x m matrix over columns
+// [e0, e0 + len), len <= VALIDATE_TILE.
+typedef void (*SweepFn)(const int* mat, int n, size_t m, int e0, int len, ColumnLanes& L);
+
+static inline void sweep_lane(int x, int v, int j, ColumnLanes& L){
+    if(x == 0) return;
+    L.cnt[j]++;
+    if(x > 0){ L.npos[j]++; L.pos[j] = v; }
+    else L.neg[j] = v;
+}
+
+static void sweep_scalar(const int* mat, int n, size_t m, int e0, int len, ColumnLanes& L){
+    for(int v=0; v<n; v++){
+        const int* row = mat + v*m + e0;
+        for(int j=0; j<len; j++) sweep_lane(row[j], v, j, L);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Compare masks are -1 per true lane: subtracting one counts it.
+__attribute__((target("avx2")))
+static void sweep_avx2(const int* mat, int n, size_t m, int e0, int len, ColumnLanes& L){
+    const __m256i zero = _mm256_setzero_si256();
+    for(int v=0; v<n; v++){
+        const int* row = mat + v*m + e0;
+        const __m256i vv = _mm256_set1_epi32(v);
+        int j = 0;
+        for(; j + 8 <= len; j += 8){
+            __m256i x  = _mm256_loadu_si256((const __m256i*)(row + j));
+            __m256i gt = _mm256_cmpgt_epi32(x, zero);
+            __m256i lt = _mm256_cmpgt_epi32(zero, x);
+            __m256i* cnt  = (__m256i*)(L.cnt + j);
+            __m256i* npos = (__m256i*)(L.npos + j);
+            __m256i* pos  = (__m256i*)(L.pos + j);
+            __m256i* neg  = (__m256i*)(L.neg + j);
+            *cnt  = _mm256_sub_epi32(*cnt, _mm256_or_si256(gt, lt));
+            *npos = _mm256_sub_epi32(*npos, gt);
+            *pos  = _mm256_blendv_epi8(*pos, vv, gt);
+            *neg  = _mm256_blendv_epi8(*neg, vv, lt);
+        }
+        for(; j<len; j++) sweep_lane(row[j], v, j, L);
+    }
+}
+
+__attribute__((target("sse2")))
+static void sweep_sse2(const int* mat, int n, size_t m, int e0, int len, ColumnLanes& L){
+    const __m128i zero = _mm_setzero_si128();
+    for(int v=0; v<n; v++){
+        const int* row = mat + v*m + e0;
+        const __m128i vv = _mm_set1_epi32(v);
+        int j = 0;
+        for(; j + 4 <= len; j += 4){
+            __m128i x  = _mm_loadu_si128((const __m128i*)(row + j));
+            __m128i gt = _mm_cmpgt_epi32(x, zero);
+            __m128i lt = _mm_cmplt_epi32(x, zero);
+            __m128i* cnt  = (__m128i*)(L.cnt + j);
+            __m128i* npos = (__m128i*)(L.npos + j);
+            __m128i* pos  = (__m128i*)(L.pos + j);
+            __m128i* neg  = (__m128i*)(L.neg + j);
+            *cnt  = _mm_sub_epi32(*cnt, _mm_or_si128(gt, lt));
+            *npos = _mm_sub_epi32(*npos, gt);
+            *pos  = _mm_or_si128(_mm_and_si128(gt, vv), _mm_andnot_si128(gt, *pos));
+            *neg  = _mm_or_si128(_mm_and_si128(lt, vv), _mm_andnot_si128(lt, *neg));
+        }
+        for(; j<len; j++) sweep_lane(row[j], v, j, L);
+    }
+}
+#endif
+
+static SweepFn pick_sweep(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return sweep_avx2;
+    if(__builtin_cpu_supports("sse2")) return sweep_sse2;
+#endif
+    return sweep_scalar;
+}
+
+static SweepFn sweep_columns = pick_sweep();
+
+/*==========================================================================
+ * GRAPH BUILD (CSR)
+ *==========================================================================*/
+
+bool incidence_to_edges(int n, int m, const int* mat, const int* W, vector<Edge>& out){
+    out.resize(m);
+    ColumnLanes L;
+    for(int e0=0; e0<m; e0+=VALIDATE_TILE){
+        int len = min(VALIDATE_TILE, m - e0);
+        fill(L.cnt,  L.cnt  + len, 0);
+        fill(L.npos, L.npos + len, 0);
+        fill(L.pos,  L.pos  + len, -1);
+        fill(L.neg,  L.neg  + len, -1);
+        sweep_columns(mat, n, m, e0, len, L);
+
+        for(int j=0; j<len; j++){
+            if(L.cnt[j] != 2 || L.npos[j] != 1) return false;
+            int w = W[e0 + j];
+            if(w < 0) w = -w;
+            out[e0 + j] = {L.pos[j], L.neg[j], w};
+        }
+    }
+    return true;
+}
+
+bool valid_edges(int n, const Edge* edges, size_t m){
+    for(size_t i=0;i<m;i++){
+        const Edge& e = edges[i];
+        if(e.u < 0 || e.u >= n || e.v < 0 || e.v >= n || e.u == e.v || e.w < 0)
+            return false;
+    }
+    return true;
+}
+
+bool valid_edges(int n, const vector<Edge>& edges){
+    return valid_edges(n, edges.data(), edges.size());
+}
+
+bool decode_varint_edges(const vector<uint8_t>& bytes, int m, vector<Edge>& out){
+    const uint8_t* p   = bytes.data();
+    const uint8_t* end = p + bytes.size();
+    int64_t prev_u = 0;
+
+    // each edge takes at least three bytes; check before allocating
+    if((uint64_t)m * 3 > bytes.size()) return false;
+    out.resize(m);
+    for(int e=0; e<m; e++){
+        uint64_t du, dv, w;
+        if(!(p = get_varint(p, end, du)) || !(p = get_varint(p, end, dv)) ||
+           !(p = get_varint(p, end, w)))
+            return false;
+
+        // deltas between int32 ids fit in 32 bits; anything larger could
+        // also overflow the sums below
+        if(du > UINT32_MAX || dv > UINT32_MAX) return false;
+        int64_t u = prev_u + unzigzag(du);
+        int64_t v = u + unzigzag(dv);
+        if(u < 0 || u > INT32_MAX || v < 0 || v > INT32_MAX || w > INT32_MAX)
+            return false;
+        out[e] = {(int)u, (int)v, (int)w};
+        prev_u = u;
+    }
+    return p == end;
+}
+
+// Counting-sort construction: one pass for degrees, one prefix sum, one
+// scatter pass. Arcs keep the input edge order within each vertex.
+CsrGraph build_csr(int n, const Edge* edges, size_t m){
+    CsrGraph g;
+    g.n = n;
+    g.off.assign(n + 1, 0);
+    g.arcs.resize(2 * m);
+
+    for(size_t i=0;i<m;i++){
+        g.off[edges[i].u + 1]++;
+        g.off[edges[i].v + 1]++;
+    }
+    for(int v=0; v<n; v++) g.off[v + 1] += g.off[v];
+
+    // off[v] doubles as the write cursor of v and ends up at off[v+1],
+    // so shifting by one slot afterwards restores the row starts.
+    for(size_t i=0;i<m;i++){
+        const Edge& e = edges[i];
+        g.arcs[g.off[e.u]++] = {e.v, e.w};
+        g.arcs[g.off[e.v]++] = {e.u, e.w};
+    }
+    for(int v=n; v>0; v--) g.off[v] = g.off[v - 1];
+    g.off[0] = 0;
+    return g;
+}
+
+CsrGraph build_csr(int n, const vector<Edge>& edges){
+    return build_csr(n, edges.data(), edges.size());
+}
+
+/*==========================================================================
+ * PRIORITY QUEUES FOR DIJKSTRA
+ *==========================================================================*/
+
+// Every queue offers the same three calls to dijkstra:
+//   push(v, key)  insert v, or lower its key if already queued
+//   pop()         remove and return the (key, v) pair with the lowest key
+//   empty()
+// Lazy queues may hand back stale pairs; dijkstra skips those itself.
+
+// std::priority_queue with lazy deletion (duplicates instead of decrease-key).
+class BinaryHeapPQ {
+public:
+    explicit BinaryHeapPQ(int) {}
+    bool empty() const { return pq.empty(); }
+    void push(int v, long long key){ pq.push({key, v}); }
+    pair<long long,int> pop(){
+        auto top = pq.top();
+        pq.pop();
+        return top;
+    }
+
+private:
+    priority_queue<pair<long long,int>, vector<pair<long long,int>>, greater<>> pq;
+};
+
+// Indexed D-ary heap: at most one entry per vertex, true decrease-key.
+template<int D>
+class DaryHeapPQ {
+public:
+    explicit DaryHeapPQ(int n) : pos(n, -1), key(n) { heap.reserve(64); }
+    bool empty() const { return heap.empty(); }
+
+    void push(int v, long long k){
+        key[v] = k;
+        if(pos[v] < 0){
+            pos[v] = heap.size();
+            heap.push_back(v);
+        }
+        sift_up(pos[v]);
+    }
+
+    pair<long long,int> pop(){
+        int top = heap[0];
+        int last = heap.back();
+        heap.pop_back();
+        pos[top] = -1;
+        if(!heap.empty()){
+            heap[0] = last;
+            pos[last] = 0;
+            sift_down(0);
+        }
+        return {key[top], top};
+    }
+
+private:
+    vector<int> heap;       // vertex ids
+    vector<int> pos;        // index in heap, -1 if absent
+    vector<long long> key;
+
+    void sift_up(int i){
+        int v = heap[i];
+        while(i > 0){
+            int p = (i - 1) / D;
+            if(key[heap[p]] <= key[v]) break;
+            heap[i] = heap[p];
+            pos[heap[i]] = i;
+            i = p;
+        }
+        heap[i] = v;
+        pos[v] = i;
+    }
+
+    void sift_down(int i){
+        int v = heap[i];
+        int sz = heap.size();
+        while(true){
+            int c = i * D + 1;
+            if(c >= sz) break;
+            int best = c;
+            int end = min(c + D, sz);
+            for(int j=c+1; j<end; j++)
+                if(key[heap[j]] < key[heap[best]]) best = j;
+            if(key[heap[best]] >= key[v]) break;
+            heap[i] = heap[best];
+            pos[heap[i]] = i;
+            i = best;
+        }
+        heap[i] = v;
+        pos[v] = i;
+    }
+};
+
+// Monotone radix heap for non-negative integer keys: bucket i holds keys
+// whose highest bit differing from the last popped key is bit i-1. Only
+// valid because dijkstra never pushes a key below the last one popped.
+class RadixHeapPQ {
+public:
+    explicit RadixHeapPQ(int) {}
+    bool empty() const { return count == 0; }
+
+    void push(int v, long long k){
+        buckets[bucket_of(k)].push_back({k, v});
+        count++;
+    }
+
+    pair<long long,int> pop(){
+        if(buckets[0].empty()){
+            int i = 1;
+            while(buckets[i].empty()) i++;
+
+            unsigned long long mn = ULLONG_MAX;
+            for(auto& e : buckets[i]) mn = min(mn, e.first);
+            last = mn;
+            for(auto& e : buckets[i]) buckets[bucket_of(e.first)].push_back(e);
+            buckets[i].clear();
+        }
+        auto top = buckets[0].back();
+        buckets[0].pop_back();
+        count--;
+        return {(long long)top.first, top.second};
+    }
+
+private:
+    vector<pair<unsigned long long,int>> buckets[65];
+    unsigned long long last = 0;
+    size_t count = 0;
+
+    int bucket_of(unsigned long long k) const {
+        return k == last ? 0 : 64 - __builtin_clzll(k ^ last);
+    }
+};
+
+// auto: binary heap below PQ_AUTO_RADIX_N vertices, radix heap above.
+// On 1M-vertex grids and random graphs the radix heap ran 2.6-3.3x faster
+// than either heap; on v1-sized graphs its bucket setup made it slower.
+PqKind PQ_KIND = PQ_AUTO;
+const int PQ_AUTO_RADIX_N = 1024;
+
+bool parse_pq(const string& s, PqKind& k){
+    if(s == "auto") k = PQ_AUTO;
+    else if(s == "binary") k = PQ_BINARY;
+    else if(s == "dary") k = PQ_DARY;
+    else if(s == "radix") k = PQ_RADIX;
+    else return false;
+    return true;
+}
+
+/*==========================================================================
+ * DIJKSTRA
+ *==========================================================================*/
+
+// Settles vertices from S until T is settled (T = -1: the whole
+// component). Returns the number of vertices settled.
+template<class PQ>
+long long dijkstra_run(const CsrGraph& g, int S, int T,
+                       vector<long long>& dist, vector<int>& parent){
+    int n = g.n;
+    dist.assign(n, INF);
+    parent.assign(n, -1);
+
+    dist[S] = 0;
+    PQ pq(n);
+    pq.push(S, 0);
+
+    const uint32_t* off = g.off.data();
+    const Arc* arcs = g.arcs.data();
+    long long settled = 0;
+
+    while(!pq.empty()){
+        auto [d,u] = pq.pop();
+        if(d != dist[u]) continue;   // stale entry of a lazy queue
+        settled++;
+        if(u == T) break;
+
+        for(uint32_t i = off[u]; i < off[u+1]; i++){
+            int v = arcs[i].to;
+            long long nd = d + arcs[i].w;
+            if(dist[v] > nd){
+                dist[v] = nd;
+                parent[v] = u;
+                pq.push(v, nd);
+            }
+        }
+    }
+    return settled;
+}
+
+PathResult path_to(const vector<long long>& dist, const vector<int>& parent, int T){
+    PathResult R;
+    if(dist[T] == INF){
+        R.ok = false;
+        return R;
+    }
+
+    R.ok = true;
+    R.dist = dist[T];
+    int x = T;
+
+    while(x != -1){
+        R.path.push_back(x);
+        x = parent[x];
+    }
+    reverse(R.path.begin(), R.path.end());
+    return R;
+}
+
+template<class PQ>
+PathResult dijkstra_with(const CsrGraph& g, int S, int T){
+    vector<long long> dist;
+    vector<int> parent;
+    long long settled = dijkstra_run<PQ>(g, S, T, dist, parent);
+
+    PathResult R = path_to(dist, parent, T);
+    R.settled = settled;
+    return R;
+}
+
+/*==========================================================================
+ * BIDIRECTIONAL DIJKSTRA
+ *==========================================================================*/
+
+// Alternates a forward search from S and a backward search from T (the
+// graph is undirected, so both walk the same CSR). mu is the best S-T
+// length seen through an arc joining the two searches; the search stops
+// once the key about to be settled plus the last key settled on the
+// other side reaches mu, since no unsettled vertex can then improve it.
+template<class PQ>
+PathResult bidir_with(const CsrGraph& g, int S, int T){
+    int n = g.n;
+    vector<long long> dist[2] = {vector<long long>(n, INF), vector<long long>(n, INF)};
+    vector<int> parent[2] = {vector<int>(n, -1), vector<int>(n, -1)};
+    PQ pq[2] = {PQ(n), PQ(n)};
+    long long last[2] = {0, 0};
+
+    dist[0][S] = 0; pq[0].push(S, 0);
+    dist[1][T] = 0; pq[1].push(T, 0);
+
+    long long mu = S == T ? 0 : INF;
+    int meet_f = S, meet_b = T;        // arc meet_f -> meet_b closes the best path
+    long long settled = 0;
+
+    const uint32_t* off = g.off.data();
+    const Arc* arcs = g.arcs.data();
+
+    for(int side = 0; !pq[0].empty() && !pq[1].empty(); side ^= 1){
+        auto [d,u] = pq[side].pop();
+        if(d != dist[side][u]) continue;
+        if(d + last[side ^ 1] >= mu) break;
+        last[side] = d;
+        settled++;
+
+        const vector<long long>& other = dist[side ^ 1];
+        for(uint32_t i = off[u]; i < off[u+1]; i++){
+            int v = arcs[i].to;
+            long long nd = d + arcs[i].w;
+            if(dist[side][v] > nd){
+                dist[side][v] = nd;
+                parent[side][v] = u;
+                pq[side].push(v, nd);
+            }
+            if(other[v] != INF && nd + other[v] < mu){
+                mu = nd + other[v];
+                meet_f = side == 0 ? u : v;
+                meet_b = side == 0 ? v : u;
+            }
+        }
+    }
+
+    PathResult R;
+    R.settled = settled;
+    if(mu == INF){
+        R.ok = false;
+        return R;
+    }
+
+    R.ok = true;
+    R.dist = mu;
+    for(int x = meet_f; x != -1; x = parent[0][x]) R.path.push_back(x);
+    reverse(R.path.begin(), R.path.end());
+    if(S != T)
+        for(int x = meet_b; x != -1; x = parent[1][x]) R.path.push_back(x);
+    return R;
+}
+
+/*==========================================================================
+ * ALT (A* WITH LANDMARKS)
+ *==========================================================================*/
+
+int ALT_LANDMARKS = 8;
+
+// Farthest-point selection: each new landmark is the vertex farthest
+// from all landmarks chosen so far (within the component of vertex 0
+// first, then of whatever is still unreached).
+template<class PQ>
+Landmarks build_landmarks_with(const CsrGraph& g, int k){
+    Landmarks L;
+    if(g.n == 0) return L;
+
+    vector<long long> nearest(g.n, INF), dist;
+    vector<int> parent;
+
+    // Seed with the vertex farthest from 0 rather than 0 itself.
+    dijkstra_run<PQ>(g, 0, -1, dist, parent);
+    int next = 0;
+    for(int v=0; v<g.n; v++)
+        if(dist[v] != INF && dist[v] > dist[next]) next = v;
+
+    for(int i=0; i<k && i<g.n; i++){
+        dijkstra_run<PQ>(g, next, -1, dist, parent);
+        L.ids.push_back(next);
+
+        for(int v=0; v<g.n; v++) nearest[v] = min(nearest[v], dist[v]);
+        L.dist.push_back(move(dist));
+
+        next = -1;
+        for(int v=0; v<g.n; v++)
+            if(nearest[v] != 0 && (next < 0 || nearest[v] > nearest[next])) next = v;
+        if(next < 0) break;   // every vertex is a landmark
+    }
+    return L;
+}
+
+template<class PQ>
+PathResult alt_with(const CsrGraph& g, const Landmarks& L, int S, int T){
+    int n = g.n;
+    vector<long long> dist(n, INF), h(n, -1);
+    vector<int> parent(n, -1);
+
+    auto potential = [&](int v){
+        if(h[v] < 0){
+            long long best = 0;
+            for(auto& dl : L.dist){
+                if(dl[v] == INF || dl[T] == INF) continue;
+                best = max(best, llabs(dl[T] - dl[v]));
+            }
+            h[v] = best;
+        }
+        return h[v];
+    };
+
+    dist[S] = 0;
+    PQ pq(n);
+    pq.push(S, potential(S));
+
+    const uint32_t* off = g.off.data();
+    const Arc* arcs = g.arcs.data();
+    long long settled = 0;
+
+    while(!pq.empty()){
+        auto [f,u] = pq.pop();
+        if(f != dist[u] + h[u]) continue;
+        settled++;
+        if(u == T) break;
+
+        for(uint32_t i = off[u]; i < off[u+1]; i++){
+            int v = arcs[i].to;
+            long long nd = dist[u] + arcs[i].w;
+            if(dist[v] > nd){
+                dist[v] = nd;
+                parent[v] = u;
+                pq.push(v, nd + potential(v));
+            }
+        }
+    }
+
+    PathResult R = path_to(dist, parent, T);
+    R.settled = settled;
+    return R;
+}
+
+/*==========================================================================
+ * SEARCH DISPATCH
+ *==========================================================================*/
+
+SearchMode SEARCH_KIND = SEARCH_MODE_DIJKSTRA;
+
+bool parse_search(const string& s, SearchMode& m){
+    if(s == "dijkstra") m = SEARCH_MODE_DIJKSTRA;
+    else if(s == "bidir") m = SEARCH_MODE_BIDIR;
+    else if(s == "alt") m = SEARCH_MODE_ALT;
+    else return false;
+    return true;
+}
+
+template<class T> struct PqTag { using type = T; };
+
+// Calls f(PqTag<Queue>{}) with the queue type selected by pq.
+template<class F>
+auto with_pq(PqKind pq, int n, F&& f){
+    if(pq == PQ_AUTO) pq = n < PQ_AUTO_RADIX_N ? PQ_BINARY : PQ_RADIX;
+
+    switch(pq){
+        case PQ_BINARY: return f(PqTag<BinaryHeapPQ>{});
+        case PQ_DARY:   return f(PqTag<DaryHeapPQ<4>>{});
+        default:        return f(PqTag<RadixHeapPQ>{});
+    }
+}
+
+PathResult dijkstra(const CsrGraph& g, int S, int T, PqKind pq){
+    return with_pq(pq, g.n, [&](auto tag){
+        return dijkstra_with<typename decltype(tag)::type>(g, S, T);
+    });
+}
+
+void sssp(const CsrGraph& g, int S, vector<long long>& dist, vector<int>& parent){
+    with_pq(PQ_KIND, g.n, [&](auto tag){
+        return dijkstra_run<typename decltype(tag)::type>(g, S, -1, dist, parent);
+    });
+}
+
+Landmarks build_landmarks(const CsrGraph& g, int k){
+    return with_pq(PQ_KIND, g.n, [&](auto tag){
+        return build_landmarks_with<typename decltype(tag)::type>(g, k);
+    });
+}
+
+PathResult shortest_path(const CsrGraph& g, int S, int T, SearchMode mode,
+                         const Landmarks* lm){
+    return with_pq(PQ_KIND, g.n, [&](auto tag){
+        using PQ = typename decltype(tag)::type;
+        if(mode == SEARCH_MODE_ALT && lm) return alt_with<PQ>(g, *lm, S, T);
+        // landmarks cost K+1 full searches: never build them for one query
+        if(mode == SEARCH_MODE_ALT || mode == SEARCH_MODE_BIDIR) return bidir_with<PQ>(g, S, T);
+        return dijkstra_with<PQ>(g, S, T);
+    });
+}
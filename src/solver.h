@@ -0,0 +1,101 @@
+// solver.h - graph validation, CSR build and shortest-path search
+//
+// Shared by the server and the benchmarks (bench.cpp). Everything here
+// is independent of the network code; graphs are read-only once built,
+// so any number of threads may search the same CsrGraph.
+
+#pragma once
+#include <bits/stdc++.h>
+#include "protocol.h"
+using namespace std;
+
+/*==========================================================================
+ * VALIDATION
+ *==========================================================================*/
+
+struct Edge {
+    int u, v, w;
+};
+
+// UDP (v1) graph size limits.
+bool valid_nm(int n, int m);
+
+// Extracts one edge per incidence column; fails unless every column has
+// exactly two non-zeros, one positive and one negative.
+bool incidence_to_edges(int n, int m, const int* mat, const int* W, vector<Edge>& out);
+
+// Endpoints distinct and in range, w >= 0. The matrix form has no sign
+// of its own for weights and takes |w| from the weight row instead.
+bool valid_edges(int n, const Edge* edges, size_t m);
+bool valid_edges(int n, const vector<Edge>& edges);
+
+bool decode_varint_edges(const vector<uint8_t>& bytes, int m, vector<Edge>& out);
+
+/*==========================================================================
+ * GRAPH BUILD (CSR)
+ *==========================================================================*/
+
+const long long INF = (1LL << 60);
+
+// Compressed sparse row adjacency: the neighbours of u are
+// arcs[off[u] .. off[u+1]), packed next to their weights.
+struct Arc {
+    int to, w;
+};
+
+struct CsrGraph {
+    int n = 0;
+    vector<uint32_t> off;   // n+1 entries
+    vector<Arc> arcs;       // 2 per undirected edge
+};
+
+CsrGraph build_csr(int n, const Edge* edges, size_t m);
+CsrGraph build_csr(int n, const vector<Edge>& edges);
+
+/*==========================================================================
+ * SEARCH
+ *==========================================================================*/
+
+struct PathResult {
+    long long dist;
+    vector<int> path;
+    bool ok;
+    long long settled = 0;   // vertices removed from the queue(s)
+};
+
+enum PqKind { PQ_AUTO, PQ_BINARY, PQ_DARY, PQ_RADIX };
+
+enum SearchMode { SEARCH_MODE_DIJKSTRA = SEARCH_DIJKSTRA,
+                  SEARCH_MODE_BIDIR    = SEARCH_BIDIR,
+                  SEARCH_MODE_ALT      = SEARCH_ALT };
+
+// Exact distances from a few well-spread vertices. By the triangle
+// inequality |d(L,t) - d(L,v)| <= d(v,t) for every landmark L, which
+// gives A* a consistent lower bound.
+struct Landmarks {
+    vector<int> ids;
+    vector<vector<long long>> dist;   // dist[i][v] = d(ids[i], v)
+};
+
+// Server-wide defaults, set from the command line.
+extern PqKind PQ_KIND;
+extern SearchMode SEARCH_KIND;
+extern int ALT_LANDMARKS;
+
+bool parse_pq(const string& s, PqKind& k);
+bool parse_search(const string& s, SearchMode& m);
+
+PathResult dijkstra(const CsrGraph& g, int S, int T, PqKind pq = PQ_KIND);
+
+// Full single-source search: dist and parent for every vertex.
+void sssp(const CsrGraph& g, int S, vector<long long>& dist, vector<int>& parent);
+
+// Walks parent links back from T.
+PathResult path_to(const vector<long long>& dist, const vector<int>& parent, int T);
+
+Landmarks build_landmarks(const CsrGraph& g, int k = ALT_LANDMARKS);
+
+// Point-to-point query with any search mode. ALT needs precomputed
+// landmarks; without them it runs as bidirectional Dijkstra.
+PathResult shortest_path(const CsrGraph& g, int S, int T, SearchMode mode,
+                         const Landmarks* lm = nullptr);